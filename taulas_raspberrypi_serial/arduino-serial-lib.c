@@ -130,7 +130,8 @@ int serialport_write(int fd, const char * str)
   return 0;
 }
 
-//
+// reads until the 'until' char, buf_max chars or timeout milliseconds
+// returns 0 on success, -1 if the port couldn't be read, -2 on timeout
 int serialport_read_until(int fd, char* buf, char until, int buf_max, int timeout)
 {
   char b[1] = {0};  // read expects an array, so we give it a 1-byte array
@@ -149,6 +150,7 @@ int serialport_read_until(int fd, char* buf, char until, int buf_max, int timeou
 
   buf[i] = 0;  // null terminate the string
   tcflush(fd, TCIOFLUSH);
+  if( b[0]!=until && timeout<=0 ) return -2; // until char never came
   return 0;
 }
 
@@ -158,3 +160,9 @@ int serialport_flush(int fd)
   sleep(2); //required to make flush work, for some reason
   return tcflush(fd, TCIOFLUSH);
 }
+
+// discard the pending input without waiting, for a port already settled
+int serialport_discard(int fd)
+{
+  return tcflush(fd, TCIFLUSH);
+}
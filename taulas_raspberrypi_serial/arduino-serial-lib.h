@@ -39,6 +39,7 @@ int serialport_writebyte( int fd, uint8_t b);
 int serialport_write(int fd, const char * str);
 int serialport_read_until(int fd, char * buf, char until, int buf_max, int timeout);
 int serialport_flush(int fd);
+int serialport_discard(int fd);
 
 #endif
 
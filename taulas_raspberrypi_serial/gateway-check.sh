@@ -0,0 +1,223 @@
+#!/bin/sh
+#
+# Taulas RPI Serial interface
+#
+# Check the gateway mode against local nodes: each node is a taulas-rpi-serial connected to a device emulator
+# - EMU0: answers in time
+# - EMU0 on another port: answers in time with a duplicate device name
+# - EMU2: emulated on a slow link, misses the deadline
+# - ESP0: served over HTTP like the ESP8266 webserver, answers OVERVIEW with an error and the status 200
+# - a url answering 404, and a port where nothing listens
+# The gateway is a taulas-rpi-serial without device, it must answer before the deadline
+# with the overviews of the two first nodes and the errors of the other ones
+# Two requests sent at the same time must both answer before the deadline
+# Then the first node is stopped, its error must be keyed by its device name
+#
+# Usage: gateway-check.sh
+#
+# Environment variables:
+# - GATEWAY_PORT: first TCP port used, the nodes use the next ones, default 18600
+# - GATEWAY_DEADLINE: upstream deadline in milliseconds, default 1000
+#
+# Copyright 2016 Nicolas Mora <mail@babelouest.org>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public License
+# as published by the Free Software Foundation;
+# version 2.1 of the License.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU GENERAL PUBLIC LICENSE for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+PORT=${GATEWAY_PORT:-18600}
+DEADLINE=${GATEWAY_DEADLINE:-1000}
+WORK=$(mktemp -d)
+PIDS=
+FAILED=0
+
+cleanup() {
+  for pid in $PIDS; do
+    kill -TERM "$pid" 2>/dev/null
+  done
+  for pid in $PIDS; do
+    wait "$pid" 2>/dev/null
+  done
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# start_esp_node <port> <device name> <command failing>
+start_esp_node() {
+  "$DIR/taulas-emulator" --http-port="$1" --name="$2" --fail="$3" > "$WORK/emulator-esp.log" &
+  PIDS="$PIDS $!"
+}
+
+# start_node <id> <port> <device name> <emulator baud>
+start_node() {
+  "$DIR/taulas-emulator" --link="$WORK/tty$1" --name="$3" --baud="$4" > "$WORK/emulator-$1.log" &
+  PIDS="$PIDS $!"
+  i=0
+  while [ ! -e "$WORK/tty${1}0" ]; do
+    i=$((i+1))
+    if [ $i -gt 50 ]; then
+      echo "Emulator $1 not started" >&2
+      exit 1
+    fi
+    sleep 0.1
+  done
+  "$DIR/taulas-rpi-serial" --port="$2" --serial-pattern="$WORK/tty$1" --timeout=5000 --rate-limit=0 --rules-interval=0 \
+    --shm-name=none --log-mode=console --log-level=ERROR > "$WORK/node-$1.log" 2>&1 &
+  NODE_PID=$!
+  PIDS="$PIDS $NODE_PID"
+}
+
+# wait_http <port> <log file>
+wait_http() {
+  i=0
+  while ! curl -s -o /dev/null "http://127.0.0.1:$1/"; do
+    i=$((i+1))
+    if [ $i -gt 300 ]; then
+      echo "taulas-rpi-serial on port $1 not started" >&2
+      cat "$2" >&2
+      exit 1
+    fi
+    sleep 0.1
+  done
+}
+
+# fetch_gateway <name>: the response is written in <name>.raw, the status and the duration in <name>.result
+fetch_gateway() {
+  curl -s -o "$WORK/$1.raw" -w '%{http_code} %{time_total}' "http://127.0.0.1:$PORT/taulas/gateway" > "$WORK/$1.result"
+}
+
+# check_gateway <name> <number of nodes expected> <number of nodes answering expected>
+check_gateway() {
+  result=$(cat "$WORK/$1.result")
+  # Same layout whatever the json indentation
+  tr -d '\n' < "$WORK/$1.raw" | sed 's/": */":/g; s/, *"/,"/g; s/{ *"/{"/g' > "$WORK/gateway.json"
+  status=${result% *}
+  duration_ms=$(echo "${result#* }" | awk '{printf("%d", $1*1000)}')
+  if [ "$status" = "200" ]; then
+    echo "OK   status 200"
+  else
+    echo "FAIL status $status"
+    FAILED=1
+  fi
+  if [ "$duration_ms" -lt $((DEADLINE+500)) ]; then
+    echo "OK   answered in $duration_ms ms, deadline $DEADLINE ms"
+  else
+    echo "FAIL answered in $duration_ms ms, deadline $DEADLINE ms"
+    FAILED=1
+  fi
+  expect "$2 nodes, $3 answered" "\"nodes\":$2,\"ok\":$3"
+  entries=$(grep -o '{"url":' "$WORK/gateway.json" | wc -l)
+  if [ "$entries" -eq "$2" ]; then
+    echo "OK   $2 entries"
+  else
+    echo "FAIL $entries entries, expected $2"
+    FAILED=1
+  fi
+}
+
+# request_gateway <number of nodes expected> <number of nodes answering expected>
+request_gateway() {
+  fetch_gateway gateway
+  check_gateway gateway "$1" "$2"
+}
+
+# expect <description> <string expected in the response>
+expect() {
+  if grep -qF -- "$2" "$WORK/gateway.json"; then
+    echo "OK   $1"
+  else
+    echo "FAIL $1: $2 not found"
+    FAILED=1
+  fi
+}
+
+URL_OK="http://127.0.0.1:$((PORT+1))/taulas"
+URL_DUPLICATE="http://127.0.0.1:$((PORT+2))/taulas"
+URL_SLOW="http://127.0.0.1:$((PORT+3))/taulas"
+URL_ESP="http://127.0.0.1:$((PORT+4))/taulas"
+URL_NOT_FOUND="http://127.0.0.1:$((PORT+1))/missing"
+URL_DOWN="http://127.0.0.1:$((PORT+9))/taulas"
+
+start_node a $((PORT+1)) EMU0 0
+NODE_A_PID=$NODE_PID
+start_node b $((PORT+2)) EMU0 0
+# At 150 bauds, the NAME exchange lasts 2 seconds
+start_node c $((PORT+3)) EMU2 150
+start_esp_node $((PORT+4)) ESP0 OVERVIEW
+wait_http $((PORT+1)) "$WORK/node-a.log"
+wait_http $((PORT+2)) "$WORK/node-b.log"
+wait_http $((PORT+3)) "$WORK/node-c.log"
+wait_http $((PORT+4)) "$WORK/emulator-esp.log"
+
+"$DIR/taulas-rpi-serial" --port="$PORT" --serial-pattern="$WORK/none" --rate-limit=0 --rules-interval=0 --shm-name=none \
+  --upstreams="$URL_OK,$URL_DUPLICATE,$URL_SLOW,$URL_ESP,$URL_NOT_FOUND,$URL_DOWN" --upstream-deadline="$DEADLINE" \
+  --log-mode=console --log-level=ERROR > "$WORK/gateway.log" 2>&1 &
+PIDS="$PIDS $!"
+wait_http "$PORT" "$WORK/gateway.log"
+
+# The first request asks the node names, the second one uses the names known and the connections kept alive
+for run in 1 2; do
+  echo "Gateway request $run"
+  request_gateway 6 2
+  expect "node keyed by device name" "\"EMU0\":{\"url\":\"$URL_OK\",\"status\":\"ok\""
+  expect "duplicate device name keyed by url" "\"$URL_DUPLICATE\":{\"url\":\"$URL_DUPLICATE\",\"status\":\"ok\""
+  expect "overview merged" '"overview":{"sensors":{"TEMPINT0":21.5'
+  expect "slow node past the deadline" "{\"url\":\"$URL_SLOW\",\"status\":\"error\""
+  expect "slow node error" '"error":"deadline exceeded"'
+  expect "node answering an error with the status 200" "\"ESP0\":{\"url\":\"$URL_ESP\",\"status\":\"error\""
+  expect "node answering an error with the status 200 error" '"error":"device failure"'
+  expect "node answering 404" "{\"url\":\"$URL_NOT_FOUND\",\"status\":\"error\""
+  expect "node answering 404 error" '"error":"status 404"'
+  expect "node down" "{\"url\":\"$URL_DOWN\",\"status\":\"error\""
+  if [ $FAILED -ne 0 ]; then
+    cat "$WORK/gateway.raw"
+    echo
+  fi
+done
+
+echo "Two gateway requests at the same time"
+fetch_gateway concurrent1 &
+FETCH_PID=$!
+fetch_gateway concurrent2
+wait "$FETCH_PID"
+for name in concurrent1 concurrent2; do
+  check_gateway $name 6 2
+  if [ $FAILED -ne 0 ]; then
+    cat "$WORK/$name.raw"
+    echo
+  fi
+done
+
+echo "Gateway request with the first node stopped"
+kill -TERM "$NODE_A_PID"
+wait "$NODE_A_PID" 2>/dev/null
+request_gateway 6 1
+expect "node down keyed by its known name" "\"EMU0\":{\"url\":\"$URL_OK\",\"status\":\"error\""
+expect "duplicate device name still keyed by url" "\"$URL_DUPLICATE\":{\"url\":\"$URL_DUPLICATE\",\"status\":\"ok\""
+if [ $FAILED -ne 0 ]; then
+  cat "$WORK/gateway.raw"
+  echo
+fi
+
+echo "Gateway without local device"
+status=$(curl -s -o "$WORK/command.json" -w '%{http_code}' "http://127.0.0.1:$PORT/taulas?command=OVERVIEW")
+if [ "$status" = "503" ] && grep -qF 'no local device' "$WORK/command.json"; then
+  echo "OK   command status 503"
+else
+  echo "FAIL command status $status"
+  FAILED=1
+fi
+
+exit $FAILED
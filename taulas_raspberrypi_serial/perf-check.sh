@@ -0,0 +1,174 @@
+#!/bin/sh
+#
+# Taulas RPI Serial interface
+#
+# Run taulas-rpi-serial against the device emulator, then benchmark it with taulas-bench
+#
+# Usage: perf-check.sh check|baseline|train
+# - check: fail if the throughput or the p99 latency regressed past the baseline
+# - baseline: store the results as the new baseline, needed once on each machine before the first check
+# - train: only run the benchmark, used to generate the PGO profile
+#
+# Environment variables:
+# - PERF_COUNT: number of commands sent on each transport, default 500
+# - PERF_TOLERANCE: regression allowed in percent, default 10
+# - PERF_SLACK_MS: p99 latency allowed above the tolerance in milliseconds, default 0.5
+# - PERF_PORT: TCP port of taulas-rpi-serial, default 18585
+# - PERF_BASELINE: baseline file, default perf-baseline.txt
+#
+# Copyright 2016 Nicolas Mora <mail@babelouest.org>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public License
+# as published by the Free Software Foundation;
+# version 2.1 of the License.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU GENERAL PUBLIC LICENSE for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+MODE=${1:-check}
+DIR=$(cd "$(dirname "$0")" && pwd)
+COUNT=${PERF_COUNT:-500}
+TOLERANCE=${PERF_TOLERANCE:-10}
+SLACK_MS=${PERF_SLACK_MS:-0.5}
+PORT=${PERF_PORT:-18585}
+BASELINE=${PERF_BASELINE:-$DIR/perf-baseline.txt}
+WORK=$(mktemp -d)
+EMULATOR_PID=
+DAEMON_PID=
+
+cleanup() {
+  if [ -n "$DAEMON_PID" ]; then
+    kill -TERM "$DAEMON_PID" 2>/dev/null
+    # taulas-rpi-serial must exit normally to write the PGO profile
+    wait "$DAEMON_PID" 2>/dev/null
+  fi
+  if [ -n "$EMULATOR_PID" ]; then
+    kill -TERM "$EMULATOR_PID" 2>/dev/null
+    wait "$EMULATOR_PID" 2>/dev/null
+  fi
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+case "$MODE" in
+  check|baseline|train)
+    ;;
+  *)
+    echo "Usage: $0 check|baseline|train" >&2
+    exit 1
+    ;;
+esac
+
+"$DIR/taulas-emulator" --link="$WORK/tty" > "$WORK/emulator.log" &
+EMULATOR_PID=$!
+i=0
+while [ ! -e "$WORK/tty0" ]; do
+  i=$((i+1))
+  if [ $i -gt 50 ]; then
+    echo "Emulator not started" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+"$DIR/taulas-rpi-serial" --port="$PORT" --serial-pattern="$WORK/tty" --rate-limit=0 --rules-interval=0 \
+  --local-socket="$WORK/taulas.sock" --shm-name="/taulas-perf-$$" --log-mode=console --log-level=ERROR > "$WORK/daemon.log" 2>&1 &
+DAEMON_PID=$!
+# The local socket is opened once the device is connected
+i=0
+while [ ! -S "$WORK/taulas.sock" ]; do
+  i=$((i+1))
+  if [ $i -gt 300 ] || ! kill -0 "$DAEMON_PID" 2>/dev/null; then
+    echo "taulas-rpi-serial not started" >&2
+    cat "$WORK/daemon.log" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+if ! "$DIR/taulas-bench" --count="$COUNT" --url="http://127.0.0.1:$PORT/taulas" --local-socket="$WORK/taulas.sock" > "$WORK/result.txt"; then
+  echo "Benchmark failed" >&2
+  exit 1
+fi
+cat "$WORK/result.txt"
+
+case "$MODE" in
+  train)
+    exit 0
+    ;;
+  baseline)
+    {
+      echo "# taulas-rpi-serial benchmark baseline, $(uname -m), $(date -u +%Y-%m-%d)"
+      grep '^transport=' "$WORK/result.txt"
+    } > "$BASELINE"
+    echo "Baseline stored in $BASELINE"
+    exit 0
+    ;;
+esac
+
+if [ ! -f "$BASELINE" ]; then
+  echo "No baseline $BASELINE, run 'make perf-baseline' first" >&2
+  exit 1
+fi
+
+# Compare each transport of the baseline with the result
+awk -v tolerance="$TOLERANCE" -v slack="$SLACK_MS" '
+  function parse(line, values,    fields, n, i, kv) {
+    n = split(line, fields, " ")
+    for (i=1; i<=n; i++) {
+      split(fields[i], kv, "=")
+      values[kv[1]] = kv[2]
+    }
+  }
+  /^#/ { next }
+  FNR == NR {
+    parse($0, b)
+    base_rps[b["transport"]] = b["rps"]
+    base_p99[b["transport"]] = b["p99_ms"]
+    next
+  }
+  {
+    delete r
+    parse($0, r)
+    t = r["transport"]
+    if (!(t in base_rps)) {
+      next
+    }
+    checked[t] = 1
+    min_rps = base_rps[t] * (100 - tolerance) / 100
+    max_p99 = base_p99[t] * (100 + tolerance) / 100 + slack
+    if (r["errors"] + 0 > 0) {
+      printf("FAIL %s: %d errors\n", t, r["errors"])
+      failed = 1
+    }
+    if (r["rps"] + 0 < min_rps) {
+      printf("FAIL %s: throughput %.1f rps, baseline %.1f rps, minimum %.1f rps\n", t, r["rps"], base_rps[t], min_rps)
+      failed = 1
+    } else {
+      printf("OK   %s: throughput %.1f rps, baseline %.1f rps\n", t, r["rps"], base_rps[t])
+    }
+    if (r["p99_ms"] + 0 > max_p99) {
+      printf("FAIL %s: p99 latency %.3f ms, baseline %.3f ms, maximum %.3f ms\n", t, r["p99_ms"], base_p99[t], max_p99)
+      failed = 1
+    } else {
+      printf("OK   %s: p99 latency %.3f ms, baseline %.3f ms\n", t, r["p99_ms"], base_p99[t])
+    }
+  }
+  END {
+    for (t in base_rps) {
+      if (!(t in checked)) {
+        printf("FAIL %s: no result\n", t)
+        failed = 1
+      }
+    }
+    exit failed
+  }
+' "$BASELINE" "$WORK/result.txt"
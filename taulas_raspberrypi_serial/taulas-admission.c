@@ -0,0 +1,256 @@
+/**
+ * Taulas RPI Serial interface
+ *
+ * Admission control: bounded priority wait queue in front of the serial port
+ * and token bucket rate limiter per client address
+ *
+ * Copyright 2016 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "taulas-rpi-serial.h"
+
+/**
+ * Initialize the admission structure
+ */
+int init_admission(struct _taulas_config * taulas_config) {
+  struct _taulas_admission * admission = &taulas_config->admission;
+
+  memset(admission, 0, sizeof(struct _taulas_admission));
+  if (pthread_mutex_init(&admission->lock, NULL) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize Mutex Lock for admission control");
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Clean the admission structure, no request must be waiting
+ */
+void clean_admission(struct _taulas_config * taulas_config) {
+  pthread_mutex_destroy(&taulas_config->admission.lock);
+}
+
+/**
+ * Return the priority of a command
+ * Sensor readings are served after the commands that change the device state
+ */
+int get_command_priority(const char * command) {
+  if (command == NULL ||
+      0 == strncmp("OVERVIEW", command, strlen("OVERVIEW")) ||
+      0 == strncmp("SENSOR", command, strlen("SENSOR")) ||
+      0 == strncmp("NAME", command, strlen("NAME")) ||
+      0 == strncmp("MARCO", command, strlen("MARCO"))) {
+    return ADMISSION_PRIORITY_READ;
+  } else {
+    return ADMISSION_PRIORITY_WRITE;
+  }
+}
+
+/**
+ * Take a token in the bucket of the client address
+ * Return 1 if the request is allowed, 0 otherwise and set retry_after to the number of seconds to wait
+ */
+int rate_limit_client(struct _taulas_config * taulas_config, const struct _u_request * request, unsigned int * retry_after) {
+  struct _taulas_admission * admission = &taulas_config->admission;
+  struct _rate_bucket * bucket = NULL;
+  char address[NI_MAXHOST] = {0};
+  long long now;
+  int i, to_return = 1;
+
+  if (taulas_config->rate_limit <= 0) {
+    return 1;
+  }
+
+  if (request->client_address == NULL ||
+      getnameinfo(request->client_address, request->client_address->sa_family==AF_INET6?sizeof(struct sockaddr_in6):sizeof(struct sockaddr_in), address, sizeof(address), NULL, 0, NI_NUMERICHOST) != 0) {
+    strncpy(address, "unknown", NI_MAXHOST-1);
+  }
+
+  now = get_monotonic_ms();
+  pthread_mutex_lock(&admission->lock);
+  for (i=0; i<RATE_LIMIT_CLIENTS; i++) {
+    if (0 == strcmp(admission->buckets[i].address, address)) {
+      bucket = &admission->buckets[i];
+      break;
+    } else if (bucket == NULL || admission->buckets[i].last_seen < bucket->last_seen) {
+      bucket = &admission->buckets[i];
+    }
+  }
+  if (0 != strcmp(bucket->address, address)) {
+    // New client, evict the least recently seen one
+    strncpy(bucket->address, address, NI_MAXHOST-1);
+    bucket->tokens = taulas_config->rate_burst;
+  } else {
+    bucket->tokens += (double)(now - bucket->last_seen) * taulas_config->rate_limit / 1000;
+    if (bucket->tokens > taulas_config->rate_burst) {
+      bucket->tokens = taulas_config->rate_burst;
+    }
+  }
+  bucket->last_seen = now;
+  if (bucket->tokens >= 1) {
+    bucket->tokens -= 1;
+  } else {
+    *retry_after = (unsigned int)((1 - bucket->tokens) / taulas_config->rate_limit) + 1;
+    admission->shed_rate_limit++;
+    to_return = 0;
+  }
+  pthread_mutex_unlock(&admission->lock);
+
+  if (!to_return) {
+    t_log(Y_LOG_LEVEL_DEBUG, "Client rate limited client=%s retry_after=%u", address, *retry_after);
+  }
+  return to_return;
+}
+
+/**
+ * Remove a waiter from its priority list, admission lock must be held
+ */
+static void admission_unlink(struct _taulas_admission * admission, struct _admission_waiter * waiter, int priority) {
+  if (waiter->prev != NULL) {
+    waiter->prev->next = waiter->next;
+  } else {
+    admission->head[priority] = waiter->next;
+  }
+  if (waiter->next != NULL) {
+    waiter->next->prev = waiter->prev;
+  } else {
+    admission->tail[priority] = waiter->prev;
+  }
+  admission->depth--;
+}
+
+/**
+ * Wait for the serial port to be available
+ * Requests are served by priority, then in arrival order
+ * Return ADMISSION_OK when the serial port is granted, admission_leave must be called after,
+ * ADMISSION_FULL if the wait queue is full, ADMISSION_DEADLINE if the request waited for too long
+ */
+int admission_enter(struct _taulas_config * taulas_config, int priority) {
+  struct _taulas_admission * admission = &taulas_config->admission;
+  struct _admission_waiter waiter;
+  pthread_condattr_t condattr;
+  struct timespec deadline;
+  long long enqueued, waited;
+  int i, empty = 1, res = 0, to_return;
+
+  pthread_mutex_lock(&admission->lock);
+  for (i=0; i<ADMISSION_PRIORITIES; i++) {
+    empty &= (admission->head[i] == NULL);
+  }
+  if (!admission->busy && empty) {
+    admission->busy = 1;
+    admission->admitted++;
+    pthread_mutex_unlock(&admission->lock);
+    return ADMISSION_OK;
+  } else if (admission->depth >= (unsigned int)taulas_config->queue_size) {
+    admission->shed_queue_full++;
+    pthread_mutex_unlock(&admission->lock);
+    return ADMISSION_FULL;
+  }
+
+  // Queue the request at the end of its priority list
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&waiter.cond, &condattr);
+  pthread_condattr_destroy(&condattr);
+  waiter.granted = 0;
+  waiter.next = NULL;
+  waiter.prev = admission->tail[priority];
+  if (admission->tail[priority] != NULL) {
+    admission->tail[priority]->next = &waiter;
+  } else {
+    admission->head[priority] = &waiter;
+  }
+  admission->tail[priority] = &waiter;
+  admission->depth++;
+
+  enqueued = get_monotonic_ms();
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += taulas_config->queue_deadline / 1000;
+  deadline.tv_nsec += (taulas_config->queue_deadline % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  while (!waiter.granted && res != ETIMEDOUT) {
+    res = pthread_cond_timedwait(&waiter.cond, &admission->lock, &deadline);
+  }
+
+  waited = get_monotonic_ms() - enqueued;
+  if (waiter.granted) {
+    admission->admitted++;
+    admission->queue_time_total += waited;
+    if (waited > admission->queue_time_max) {
+      admission->queue_time_max = waited;
+    }
+    to_return = ADMISSION_OK;
+  } else {
+    admission_unlink(admission, &waiter, priority);
+    admission->shed_deadline++;
+    to_return = ADMISSION_DEADLINE;
+  }
+  pthread_mutex_unlock(&admission->lock);
+  pthread_cond_destroy(&waiter.cond);
+  return to_return;
+}
+
+/**
+ * Release the serial port and hand it over to the next waiting request
+ */
+void admission_leave(struct _taulas_config * taulas_config) {
+  struct _taulas_admission * admission = &taulas_config->admission;
+  struct _admission_waiter * waiter = NULL;
+  int i;
+
+  pthread_mutex_lock(&admission->lock);
+  for (i=0; i<ADMISSION_PRIORITIES && waiter == NULL; i++) {
+    if (admission->head[i] != NULL) {
+      waiter = admission->head[i];
+      admission_unlink(admission, waiter, i);
+    }
+  }
+  if (waiter != NULL) {
+    // The serial port stays busy, ownership goes to the waiter
+    waiter->granted = 1;
+    pthread_cond_signal(&waiter->cond);
+  } else {
+    admission->busy = 0;
+  }
+  pthread_mutex_unlock(&admission->lock);
+}
+
+/**
+ * Return the admission counters in a json object
+ */
+json_t * admission_stats(struct _taulas_config * taulas_config) {
+  struct _taulas_admission * admission = &taulas_config->admission;
+  json_t * j_stats;
+
+  pthread_mutex_lock(&admission->lock);
+  j_stats = json_pack("{sIsIsIsIsIsIsIsIsI}",
+                      "queue_depth", (json_int_t)admission->depth,
+                      "queue_size", (json_int_t)taulas_config->queue_size,
+                      "admitted", (json_int_t)admission->admitted,
+                      "shed_rate_limit", (json_int_t)admission->shed_rate_limit,
+                      "shed_queue_full", (json_int_t)admission->shed_queue_full,
+                      "shed_deadline", (json_int_t)admission->shed_deadline,
+                      "queue_time_total_ms", (json_int_t)admission->queue_time_total,
+                      "queue_time_max_ms", (json_int_t)admission->queue_time_max,
+                      "queue_time_avg_ms", (json_int_t)(admission->admitted?admission->queue_time_total/admission->admitted:0));
+  pthread_mutex_unlock(&admission->lock);
+  return j_stats;
+}
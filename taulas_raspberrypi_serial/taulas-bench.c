@@ -0,0 +1,222 @@
+/**
+ * Taulas RPI Serial interface
+ *
+ * Benchmark of the access paths to taulas-rpi-serial:
+ * HTTP webservice, local socket and shared memory snapshot
+ * Results are printed as key=value lines
+ *
+ * Copyright 2016 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <orcania.h>
+#include <ulfius.h>
+
+#include "taulas-client.h"
+
+#define BENCH_COUNT_DEFAULT   100
+#define BENCH_COMMAND_DEFAULT "OVERVIEW"
+#define BENCH_SHM_READS       100000
+
+/**
+ * Return the current monotonic time in microseconds
+ */
+static long long get_monotonic_us() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int compare_duration(const void * a, const void * b) {
+  long long da = *(const long long *)a, db = *(const long long *)b;
+  return (da > db) - (da < db);
+}
+
+/**
+ * Print the throughput and the latency percentiles of a run
+ */
+static void print_result(const char * transport, long long * durations, int count, int errors, long long total_us) {
+  qsort(durations, count, sizeof(long long), compare_duration);
+  printf("transport=%s requests=%d errors=%d rps=%.1f p50_ms=%.3f p99_ms=%.3f max_ms=%.3f\n",
+         transport, count, errors, total_us>0?(double)count*1000000/total_us:0.0,
+         (double)durations[count/2]/1000, (double)durations[(count*99)/100]/1000, (double)durations[count-1]/1000);
+}
+
+/**
+ * Send count commands to the local socket on one connection
+ */
+static int bench_local(const char * path, const char * command, int count) {
+  long long * durations = malloc(count * sizeof(long long)), start, begin;
+  char buffer[4096];
+  int fd, i, errors = 0, status;
+
+  if (durations == NULL || (fd = taulas_local_connect(path)) == -1) {
+    fprintf(stderr, "Error connecting local socket %s\n", path);
+    free(durations);
+    return 0;
+  }
+  begin = get_monotonic_us();
+  for (i=0; i<count; i++) {
+    start = get_monotonic_us();
+    status = taulas_local_command(fd, command, buffer, sizeof(buffer));
+    durations[i] = get_monotonic_us() - start;
+    if (status == -1) {
+      fprintf(stderr, "Error local socket connection lost\n");
+      count = i;
+      errors++;
+      break;
+    } else if (status != 200) {
+      errors++;
+    }
+  }
+  if (count > 0) {
+    print_result("local", durations, count, errors, get_monotonic_us() - begin);
+  }
+  close(fd);
+  free(durations);
+  return count > 0;
+}
+
+/**
+ * Send count commands to the webservice
+ */
+static int bench_http(const char * url, const char * command, int count) {
+  long long * durations = malloc(count * sizeof(long long)), start, begin;
+  struct _u_request request;
+  struct _u_response response;
+  int i, errors = 0, res;
+
+  if (durations == NULL) {
+    return 0;
+  }
+  begin = get_monotonic_us();
+  for (i=0; i<count; i++) {
+    ulfius_init_request(&request);
+    ulfius_init_response(&response);
+    request.http_url = msprintf("%s?command=%s", url, command);
+    start = get_monotonic_us();
+    res = ulfius_send_http_request(&request, &response);
+    durations[i] = get_monotonic_us() - start;
+    if (res != U_OK || response.status != 200) {
+      errors++;
+    }
+    ulfius_clean_request(&request);
+    ulfius_clean_response(&response);
+  }
+  print_result("http", durations, count, errors, get_monotonic_us() - begin);
+  free(durations);
+  return 1;
+}
+
+/**
+ * Read all the sensors of the shared memory snapshot
+ */
+static int bench_shm(const char * shm_name) {
+  const struct taulas_shm_snapshot * snapshot = taulas_shm_open(shm_name);
+  struct taulas_shm_snapshot copy;
+  long long start, total;
+  double value, sum = 0;
+  uint32_t i;
+  int n;
+
+  if (snapshot == NULL) {
+    fprintf(stderr, "Error opening shared memory %s\n", shm_name);
+    return 0;
+  }
+  taulas_shm_copy(snapshot, &copy);
+  start = get_monotonic_us();
+  for (n=0; n<BENCH_SHM_READS; n++) {
+    for (i=0; i<copy.nb_sensors && i<TAULAS_SHM_MAX_SENSORS; i++) {
+      if (taulas_shm_get_sensor(snapshot, copy.sensors[i].name, &value, NULL)) {
+        sum += value;
+      }
+    }
+  }
+  total = get_monotonic_us() - start;
+  printf("transport=shm sensors=%u reads=%d mean_ns=%.1f checksum=%g\n", copy.nb_sensors, BENCH_SHM_READS,
+         copy.nb_sensors>0?(double)total*1000/((double)BENCH_SHM_READS*copy.nb_sensors):0.0, sum);
+  taulas_shm_close(snapshot);
+  return 1;
+}
+
+static void print_help(const char * app_name) {
+  printf("\n%s, benchmark of taulas-rpi-serial access paths\n", app_name);
+  printf("Options available:\n");
+  printf("-h --help: Print this help message and exit\n");
+  printf("-c --command: command to send, default '%s'\n", BENCH_COMMAND_DEFAULT);
+  printf("-n --count: number of commands sent on each transport, default %d\n", BENCH_COUNT_DEFAULT);
+  printf("-u --url: url of the webservice, e.g. http://localhost:8585/taulas\n");
+  printf("-k --local-socket: path to the local socket\n");
+  printf("-g --shm-name: name of the shared memory snapshot\n\n");
+}
+
+int main(int argc, char ** argv) {
+  const char * command = BENCH_COMMAND_DEFAULT, * url = NULL, * local_socket = NULL, * shm_name = NULL;
+  int count = BENCH_COUNT_DEFAULT, next_option, ret = 0;
+  static const struct option long_options[]= {
+    {"command", required_argument, NULL, 'c'},
+    {"count", required_argument, NULL, 'n'},
+    {"url", required_argument, NULL, 'u'},
+    {"local-socket", required_argument, NULL, 'k'},
+    {"shm-name", required_argument, NULL, 'g'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ((next_option = getopt_long(argc, argv, "c:n:u:k:g:h", long_options, NULL)) != -1) {
+    switch (next_option) {
+      case 'c':
+        command = optarg;
+        break;
+      case 'n':
+        count = strtol(optarg, NULL, 10);
+        break;
+      case 'u':
+        url = optarg;
+        break;
+      case 'k':
+        local_socket = optarg;
+        break;
+      case 'g':
+        shm_name = optarg;
+        break;
+      default:
+        print_help(argv[0]);
+        return next_option=='h'?0:1;
+    }
+  }
+  if (count <= 0 || (url == NULL && local_socket == NULL && shm_name == NULL)) {
+    print_help(argv[0]);
+    return 1;
+  }
+  if (local_socket != NULL && !bench_local(local_socket, command, count)) {
+    ret = 1;
+  }
+  if (url != NULL && !bench_http(url, command, count)) {
+    ret = 1;
+  }
+  if (shm_name != NULL && !bench_shm(shm_name)) {
+    ret = 1;
+  }
+  return ret;
+}
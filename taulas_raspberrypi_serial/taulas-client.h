@@ -0,0 +1,270 @@
+/**
+ * Taulas RPI Serial interface
+ *
+ * Header-only client library for processes running on the same host as taulas-rpi-serial
+ * - read the last sensor values and alert counters in the shared memory snapshot, without lock
+ * - send commands through the local socket
+ *
+ * Copyright 2016 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __TAULAS_CLIENT_H_
+#define __TAULAS_CLIENT_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#define TAULAS_SHM_MAGIC       0x54415553 // "TAUS"
+#define TAULAS_SHM_VERSION     1
+#define TAULAS_SHM_MAX_SENSORS 64
+#define TAULAS_SHM_MAX_ALERTS  32
+#define TAULAS_SHM_NAME_SIZE   32
+
+#define TAULAS_LOCAL_MAX_FRAME 65536
+
+/**
+ * Shared memory layout
+ * The sequence is odd while taulas-rpi-serial updates the snapshot,
+ * a reader retries until it reads the same even sequence before and after reading the values
+ */
+struct taulas_shm_sensor {
+  char    name[TAULAS_SHM_NAME_SIZE];
+  double  value;
+  int64_t updated_ms; // CLOCK_MONOTONIC time of the last update
+};
+
+struct taulas_shm_alert {
+  char     name[TAULAS_SHM_NAME_SIZE];
+  uint64_t count;
+  int64_t  last_ms;   // CLOCK_MONOTONIC time of the last alert
+};
+
+struct taulas_shm_snapshot {
+  uint32_t                 magic;
+  uint32_t                 version;
+  uint32_t                 sequence;
+  uint32_t                 nb_sensors;
+  uint32_t                 nb_alerts;
+  struct taulas_shm_sensor sensors[TAULAS_SHM_MAX_SENSORS];
+  struct taulas_shm_alert  alerts[TAULAS_SHM_MAX_ALERTS];
+};
+
+/**
+ * Map the shared memory snapshot read-only, return NULL on error
+ */
+static inline const struct taulas_shm_snapshot * taulas_shm_open(const char * shm_name) {
+  struct taulas_shm_snapshot * snapshot;
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+
+  if (fd == -1) {
+    return NULL;
+  }
+  snapshot = mmap(NULL, sizeof(struct taulas_shm_snapshot), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (snapshot == MAP_FAILED) {
+    return NULL;
+  }
+  if (snapshot->magic != TAULAS_SHM_MAGIC || snapshot->version != TAULAS_SHM_VERSION) {
+    munmap(snapshot, sizeof(struct taulas_shm_snapshot));
+    return NULL;
+  }
+  return snapshot;
+}
+
+/**
+ * Unmap the shared memory snapshot
+ */
+static inline void taulas_shm_close(const struct taulas_shm_snapshot * snapshot) {
+  if (snapshot != NULL) {
+    munmap((void *)snapshot, sizeof(struct taulas_shm_snapshot));
+  }
+}
+
+/**
+ * Seqlock read helpers
+ */
+static inline uint32_t taulas_shm_read_begin(const struct taulas_shm_snapshot * snapshot) {
+  uint32_t sequence;
+
+  while ((sequence = __atomic_load_n(&snapshot->sequence, __ATOMIC_ACQUIRE)) & 1);
+  return sequence;
+}
+
+static inline int taulas_shm_read_retry(const struct taulas_shm_snapshot * snapshot, uint32_t sequence) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&snapshot->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+/**
+ * Read the last value of a sensor
+ * Return 1 if the sensor has a value, 0 otherwise
+ */
+static inline int taulas_shm_get_sensor(const struct taulas_shm_snapshot * snapshot, const char * name, double * value, int64_t * updated_ms) {
+  uint32_t sequence, i, nb_sensors;
+  int found;
+
+  do {
+    sequence = taulas_shm_read_begin(snapshot);
+    found = 0;
+    nb_sensors = snapshot->nb_sensors;
+    for (i=0; i<nb_sensors && i<TAULAS_SHM_MAX_SENSORS; i++) {
+      if (0 == strncmp(snapshot->sensors[i].name, name, TAULAS_SHM_NAME_SIZE)) {
+        *value = snapshot->sensors[i].value;
+        if (updated_ms != NULL) {
+          *updated_ms = snapshot->sensors[i].updated_ms;
+        }
+        found = 1;
+        break;
+      }
+    }
+  } while (taulas_shm_read_retry(snapshot, sequence));
+  return found;
+}
+
+/**
+ * Read the number of times an alert was sent
+ */
+static inline uint64_t taulas_shm_get_alert_count(const struct taulas_shm_snapshot * snapshot, const char * name) {
+  uint32_t sequence, i, nb_alerts;
+  uint64_t count;
+
+  do {
+    sequence = taulas_shm_read_begin(snapshot);
+    count = 0;
+    nb_alerts = snapshot->nb_alerts;
+    for (i=0; i<nb_alerts && i<TAULAS_SHM_MAX_ALERTS; i++) {
+      if (0 == strncmp(snapshot->alerts[i].name, name, TAULAS_SHM_NAME_SIZE)) {
+        count = snapshot->alerts[i].count;
+        break;
+      }
+    }
+  } while (taulas_shm_read_retry(snapshot, sequence));
+  return count;
+}
+
+/**
+ * Copy the whole snapshot consistently
+ */
+static inline void taulas_shm_copy(const struct taulas_shm_snapshot * snapshot, struct taulas_shm_snapshot * copy) {
+  uint32_t sequence;
+
+  do {
+    sequence = taulas_shm_read_begin(snapshot);
+    memcpy(copy, snapshot, sizeof(struct taulas_shm_snapshot));
+  } while (taulas_shm_read_retry(snapshot, sequence));
+}
+
+/**
+ * Local socket framing
+ * Each frame is a 32 bits big endian payload length, then the payload
+ * The request payload is the command, the response payload is a 16 bits big endian
+ * status (same values as the HTTP status), then the json response
+ * Writes use MSG_NOSIGNAL, a peer that disconnected makes the write fail instead of raising SIGPIPE
+ */
+static inline int taulas_local_write_all(int fd, const void * buffer, size_t len) {
+  const char * p = buffer;
+  ssize_t n;
+
+  while (len > 0) {
+    n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static inline int taulas_local_read_all(int fd, void * buffer, size_t len) {
+  char * p = buffer;
+  ssize_t n;
+
+  while (len > 0) {
+    n = read(fd, p, len);
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Connect to the local socket, return the socket or -1 on error
+ */
+static inline int taulas_local_connect(const char * path) {
+  struct sockaddr_un address;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd == -1) {
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path)-1);
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Send a command and read its response in buffer, null terminated
+ * Return the status of the response, or -1 on error
+ */
+static inline int taulas_local_command(int fd, const char * command, char * buffer, size_t buffer_size) {
+  uint32_t len = htonl((uint32_t)strlen(command)), payload_len;
+  uint16_t status;
+  char discard[256];
+  size_t body_len, to_read;
+
+  if (taulas_local_write_all(fd, &len, sizeof(len)) || taulas_local_write_all(fd, command, strlen(command))) {
+    return -1;
+  }
+  if (taulas_local_read_all(fd, &len, sizeof(len))) {
+    return -1;
+  }
+  payload_len = ntohl(len);
+  if (payload_len < sizeof(status) || payload_len > TAULAS_LOCAL_MAX_FRAME || taulas_local_read_all(fd, &status, sizeof(status))) {
+    return -1;
+  }
+  body_len = payload_len - sizeof(status);
+  to_read = body_len<buffer_size?body_len:buffer_size-1;
+  if (taulas_local_read_all(fd, buffer, to_read)) {
+    return -1;
+  }
+  buffer[to_read] = '\0';
+  // Skip the end of a response too large for the buffer
+  for (body_len -= to_read; body_len > 0; body_len -= to_read) {
+    to_read = body_len<sizeof(discard)?body_len:sizeof(discard);
+    if (taulas_local_read_all(fd, discard, to_read)) {
+      return -1;
+    }
+  }
+  return ntohs(status);
+}
+
+#endif
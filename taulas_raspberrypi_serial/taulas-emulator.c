@@ -0,0 +1,409 @@
+/**
+ * Taulas RPI Serial interface
+ *
+ * Taulas device emulator: answers the Taulas protocol on a pseudo terminal like taulas_tls0,
+ * so taulas-rpi-serial can be run and benchmarked without an Arduino
+ * The pseudo terminal is linked to <link>0, use <link> as the serial pattern of taulas-rpi-serial
+ * With --http-port, the emulated device is served over HTTP like the ESP8266 webserver instead
+ *
+ * Copyright 2016 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <pty.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define EMULATOR_NAME_DEFAULT "EMU0"
+#define EMULATOR_COMMAND_MAX  256
+#define EMULATOR_RESPONSE_MAX 512
+#define EMULATOR_REQUEST_MAX  1024
+#define EMULATOR_CLIENTS_MAX  16
+
+static const char * sensor_names[] = {"TEMPINT0", "HUMINT0", "TEMPEXT", "MVT0", "LUM0"};
+static const double sensor_values[] = {21.5, 45.0, 8.3, 0, 512};
+#define SENSOR_COUNT (sizeof(sensor_names)/sizeof(char *))
+
+static const char * switch_names[] = {"SW0"};
+static int switch_states[] = {0};
+#define SWITCH_COUNT (sizeof(switch_names)/sizeof(char *))
+
+static const char * dimmer_names[] = {"DI0"};
+static int dimmer_states[] = {0};
+#define DIMMER_COUNT (sizeof(dimmer_names)/sizeof(char *))
+
+static volatile sig_atomic_t running = 1;
+static const char * fail_command = NULL;
+
+static void exit_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static int find_name(const char ** names, size_t count, const char * name, size_t len) {
+  size_t i;
+
+  for (i=0; i<count; i++) {
+    if (strlen(names[i]) == len && 0 == strncmp(names[i], name, len)) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Append a json object of the switch or dimmer values
+ */
+static int append_states(char * response, size_t size, int len, const char * key, const char ** names, const int * states, size_t count) {
+  size_t i;
+
+  len += snprintf(response+len, size-len, ",\"%s\":{", key);
+  for (i=0; i<count; i++) {
+    len += snprintf(response+len, size-len, "%s\"%s\":%d", i?",":"", names[i], states[i]);
+  }
+  return len + snprintf(response+len, size-len, "}");
+}
+
+/**
+ * Set or read a switch or a dimmer, params is <name> or <name>/<value>
+ */
+static int actuator(char * response, size_t size, int len, const char * params, const char ** names, int * states, size_t count, int max) {
+  const char * value = strchr(params, '/');
+  char * end;
+  long new_value;
+  int index = find_name(names, count, params, value!=NULL?(size_t)(value-params):strlen(params));
+
+  if (index == -1) {
+    return len + snprintf(response+len, size-len, "{\"error\":\"%s not found\"}", max==1?"switch":"dimmer");
+  }
+  if (value != NULL) {
+    new_value = strtol(value+1, &end, 10);
+    if (value[1] == '\0' || *end != '\0' || new_value < 0 || new_value > max) {
+      return len + snprintf(response+len, size-len, "{\"error\":\"invalid value\"}");
+    }
+    states[index] = (int)new_value;
+  }
+  return len + snprintf(response+len, size-len, "{\"value\":%d}", states[index]);
+}
+
+/**
+ * Build the response of a command, return the response length
+ */
+static int answer(const char * device_name, char * command, char * response, size_t size) {
+  char * params = strchr(command, '/');
+  int len, index;
+  size_t i;
+
+  if (params != NULL) {
+    *params++ = '\0';
+  }
+  len = snprintf(response, size, "<%s:", command);
+  if (fail_command != NULL && 0 == strcmp(command, fail_command)) {
+    len += snprintf(response+len, size-len, "{\"error\":\"device failure\"}");
+  } else if (0 == strcmp(command, "NAME")) {
+    len += snprintf(response+len, size-len, "{\"value\":\"%s\"}", device_name);
+  } else if (0 == strcmp(command, "MARCO")) {
+    len += snprintf(response+len, size-len, "{\"value\":\"POLO\"}");
+  } else if (0 == strcmp(command, "OVERVIEW")) {
+    len += snprintf(response+len, size-len, "{\"sensors\":{");
+    for (i=0; i<SENSOR_COUNT; i++) {
+      len += snprintf(response+len, size-len, "%s\"%s\":%.1f", i?",":"", sensor_names[i], sensor_values[i]);
+    }
+    len += snprintf(response+len, size-len, "}");
+    len = append_states(response, size, len, "switches", switch_names, switch_states, SWITCH_COUNT);
+    len = append_states(response, size, len, "dimmers", dimmer_names, dimmer_states, DIMMER_COUNT);
+    len += snprintf(response+len, size-len, "}");
+  } else if (0 == strcmp(command, "SENSOR") && params != NULL) {
+    index = find_name(sensor_names, SENSOR_COUNT, params, strcspn(params, "/"));
+    if (index != -1) {
+      len += snprintf(response+len, size-len, "{\"value\":%.1f}", sensor_values[index]);
+    } else {
+      len += snprintf(response+len, size-len, "{\"error\":\"sensor not found\"}");
+    }
+  } else if (0 == strcmp(command, "SWITCH") && params != NULL) {
+    len = actuator(response, size, len, params, switch_names, switch_states, SWITCH_COUNT, 1);
+  } else if (0 == strcmp(command, "DIMMER") && params != NULL) {
+    len = actuator(response, size, len, params, dimmer_names, dimmer_states, DIMMER_COUNT, 100);
+  } else {
+    len += snprintf(response+len, size-len, "{\"error\":\"command not found\"}");
+  }
+  if ((size_t)len >= size-1) {
+    len = size-2;
+  }
+  return len + snprintf(response+len, size-len, ">");
+}
+
+/**
+ * Wait the time needed to send len bytes at baud rate, 10 bits per byte
+ */
+static void link_delay(int baud, int len) {
+  struct timespec pause;
+  long long ns;
+
+  if (baud > 0) {
+    ns = (long long)len * 10 * 1000000000LL / baud;
+    pause.tv_sec = ns / 1000000000LL;
+    pause.tv_nsec = ns % 1000000000LL;
+    nanosleep(&pause, NULL);
+  }
+}
+
+/**
+ * Answer one HTTP request like the ESP8266 webserver, the device response is sent with the status 200 even if it's an error
+ */
+static int http_answer(int fd, const char * device_name, int baud, char * request) {
+  char command[EMULATOR_COMMAND_MAX], response[EMULATOR_RESPONSE_MAX], header[128];
+  const char * body, * reason = "OK";
+  size_t command_len;
+  int status = 200, len, header_len;
+
+  if (0 == strncmp(request, "GET /taulas?command=", strlen("GET /taulas?command="))) {
+    request += strlen("GET /taulas?command=");
+    command_len = strcspn(request, " &\r\n");
+    if (command_len == 0 || command_len >= sizeof(command)) {
+      status = 400;
+    } else {
+      memcpy(command, request, command_len);
+      command[command_len] = '\0';
+      len = answer(device_name, command, response, sizeof(response));
+      link_delay(baud, command_len + 2 + len);
+      // Remove the <COMMAND: prefix and the > suffix
+      response[len-1] = '\0';
+      body = strchr(response, ':') + 1;
+    }
+  } else if (0 == strncmp(request, "GET /taulas", strlen("GET /taulas"))) {
+    status = 400;
+  } else {
+    status = 404;
+  }
+  if (status == 400) {
+    reason = "Bad Request";
+    body = "{\"error\":\"Error, use url: /taulas?command=<YOUR_COMMAND>\"}";
+  } else if (status == 404) {
+    reason = "Not Found";
+    body = "{\"error\":\"Not Found\"}";
+  }
+  header_len = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n", status, reason, strlen(body));
+  if (write(fd, header, header_len) != header_len || write(fd, body, strlen(body)) != (ssize_t)strlen(body)) {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Serve the emulated device over HTTP on the loopback interface, connections are kept alive
+ * Requests are answered one at a time, like the ESP8266 webserver
+ */
+static int emulate_http(const char * device_name, int baud, int port) {
+  struct pollfd fds[EMULATOR_CLIENTS_MAX+1];
+  char requests[EMULATOR_CLIENTS_MAX+1][EMULATOR_REQUEST_MAX];
+  size_t requests_len[EMULATOR_CLIENTS_MAX+1];
+  struct sockaddr_in address;
+  char * end;
+  int listener, i, one = 1;
+  ssize_t n;
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (listener == -1 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, EMULATOR_CLIENTS_MAX) == -1) {
+    perror("http");
+    return 1;
+  }
+  fds[0].fd = listener;
+  fds[0].events = POLLIN;
+  for (i=1; i<=EMULATOR_CLIENTS_MAX; i++) {
+    fds[i].fd = -1;
+    fds[i].events = POLLIN;
+  }
+  printf("Device %s emulated on http://127.0.0.1:%d/taulas\n", device_name, port);
+  fflush(stdout);
+
+  while (running) {
+    if (poll(fds, EMULATOR_CLIENTS_MAX+1, -1) == -1) {
+      if (errno != EINTR) {
+        break;
+      }
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      for (i=1; i<=EMULATOR_CLIENTS_MAX && fds[i].fd != -1; i++);
+      if (i <= EMULATOR_CLIENTS_MAX) {
+        fds[i].fd = accept(listener, NULL, NULL);
+        requests_len[i] = 0;
+      }
+    }
+    for (i=1; i<=EMULATOR_CLIENTS_MAX; i++) {
+      if (fds[i].fd == -1 || !(fds[i].revents & (POLLIN|POLLHUP|POLLERR))) {
+        continue;
+      }
+      n = read(fds[i].fd, requests[i]+requests_len[i], sizeof(requests[i])-1-requests_len[i]);
+      if (n > 0) {
+        requests_len[i] += n;
+        requests[i][requests_len[i]] = '\0';
+        if ((end = strstr(requests[i], "\r\n\r\n")) != NULL) {
+          n = http_answer(fds[i].fd, device_name, baud, requests[i]);
+          end += strlen("\r\n\r\n");
+          requests_len[i] -= end - requests[i];
+          memmove(requests[i], end, requests_len[i]+1);
+        } else if (requests_len[i] == sizeof(requests[i])-1) {
+          n = 0;
+        }
+      }
+      if (n <= 0) {
+        close(fds[i].fd);
+        fds[i].fd = -1;
+      }
+    }
+  }
+  for (i=0; i<=EMULATOR_CLIENTS_MAX; i++) {
+    if (fds[i].fd != -1) {
+      close(fds[i].fd);
+    }
+  }
+  return 0;
+}
+
+static void print_help(const char * app_name) {
+  printf("\n%s, taulas device emulator on a pseudo terminal\n", app_name);
+  printf("Options available:\n");
+  printf("-h --help: Print this help message and exit\n");
+  printf("-l --link: the pseudo terminal is linked to <link>0, use <link> as serial pattern for taulas-rpi-serial\n");
+  printf("-n --name: device name, default '%s'\n", EMULATOR_NAME_DEFAULT);
+  printf("-b --baud: emulated link speed to delay the responses, 0 for no delay, default 0\n");
+  printf("-f --fail: command answered with an error by the emulated device\n");
+  printf("-p --http-port: serve the device over HTTP on this port like the ESP8266 webserver, instead of a pseudo terminal\n\n");
+}
+
+int main(int argc, char ** argv) {
+  const char * link_pattern = NULL, * device_name = EMULATOR_NAME_DEFAULT;
+  char slave_path[256], link_path[256], command[EMULATOR_COMMAND_MAX], response[EMULATOR_RESPONSE_MAX], c;
+  int master, slave, next_option, baud = 0, http_port = 0, incoming = 0, len;
+  size_t command_len = 0;
+  ssize_t n;
+  struct termios toptions;
+  struct sigaction action;
+  static const struct option long_options[]= {
+    {"link", required_argument, NULL, 'l'},
+    {"name", required_argument, NULL, 'n'},
+    {"baud", required_argument, NULL, 'b'},
+    {"fail", required_argument, NULL, 'f'},
+    {"http-port", required_argument, NULL, 'p'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ((next_option = getopt_long(argc, argv, "l:n:b:f:p:h", long_options, NULL)) != -1) {
+    switch (next_option) {
+      case 'l':
+        link_pattern = optarg;
+        break;
+      case 'n':
+        device_name = optarg;
+        break;
+      case 'b':
+        baud = strtol(optarg, NULL, 10);
+        break;
+      case 'f':
+        fail_command = optarg;
+        break;
+      case 'p':
+        http_port = strtol(optarg, NULL, 10);
+        break;
+      default:
+        print_help(argv[0]);
+        return next_option=='h'?0:1;
+    }
+  }
+  if (link_pattern == NULL && http_port <= 0) {
+    print_help(argv[0]);
+    return 1;
+  }
+
+  // No SA_RESTART, so a signal interrupts the blocking read or poll
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = exit_handler;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  if (http_port > 0) {
+    // A client closing its connection mustn't stop the emulator
+    signal(SIGPIPE, SIG_IGN);
+    return emulate_http(device_name, baud, http_port);
+  }
+
+  // The slave stays open so reading the master doesn't fail between two connections of taulas-rpi-serial
+  if (openpty(&master, &slave, slave_path, NULL, NULL) == -1) {
+    perror("openpty");
+    return 1;
+  }
+  tcgetattr(slave, &toptions);
+  cfmakeraw(&toptions);
+  tcsetattr(slave, TCSANOW, &toptions);
+  snprintf(link_path, sizeof(link_path), "%s0", link_pattern);
+  unlink(link_path);
+  if (symlink(slave_path, link_path) == -1) {
+    perror("symlink");
+    return 1;
+  }
+  printf("Device %s emulated on %s, linked to %s\n", device_name, slave_path, link_path);
+  fflush(stdout);
+
+  while (running) {
+    n = read(master, &c, 1);
+    if (n <= 0) {
+      if (n == -1 && errno != EINTR && errno != EAGAIN) {
+        break;
+      }
+      continue;
+    }
+    if (c == '<') {
+      incoming = 1;
+      command_len = 0;
+    } else if (incoming && c == '>') {
+      incoming = 0;
+      command[command_len] = '\0';
+      len = answer(device_name, command, response, sizeof(response));
+      link_delay(baud, command_len + 2 + len);
+      if (write(master, response, len) != len) {
+        break;
+      }
+    } else if (incoming) {
+      if (command_len < sizeof(command)-1) {
+        command[command_len++] = c;
+      } else {
+        incoming = 0;
+      }
+    }
+  }
+  unlink(link_path);
+  close(slave);
+  close(master);
+  return 0;
+}
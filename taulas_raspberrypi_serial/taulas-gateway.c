@@ -0,0 +1,355 @@
+/**
+ * Taulas RPI Serial interface
+ *
+ * Gateway mode: send OVERVIEW to the upstream taulas nodes in parallel,
+ * and merge their responses in one document keyed by device name
+ *
+ * Copyright 2016 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "taulas-rpi-serial.h"
+
+/**
+ * Append the data received to the response buffer of the exchange
+ */
+static size_t gateway_write(char * ptr, size_t size, size_t nmemb, void * userdata) {
+  struct _gateway_exchange * exchange = (struct _gateway_exchange *)userdata;
+  size_t len = size * nmemb;
+  char * buffer;
+
+  if (exchange->buffer_len + len > GATEWAY_RESPONSE_MAX) {
+    return 0;
+  }
+  buffer = realloc(exchange->buffer, exchange->buffer_len + len + 1);
+  if (buffer == NULL) {
+    return 0;
+  }
+  exchange->buffer = buffer;
+  memcpy(exchange->buffer + exchange->buffer_len, ptr, len);
+  exchange->buffer_len += len;
+  exchange->buffer[exchange->buffer_len] = '\0';
+  return len;
+}
+
+/**
+ * Lock the connections shared by the gateway requests
+ */
+static void gateway_share_lock(CURL * curl, curl_lock_data data, curl_lock_access access, void * userptr) {
+  (void)curl;
+  (void)data;
+  (void)access;
+  pthread_mutex_lock((pthread_mutex_t *)userptr);
+}
+
+static void gateway_share_unlock(CURL * curl, curl_lock_data data, void * userptr) {
+  (void)curl;
+  (void)data;
+  pthread_mutex_unlock((pthread_mutex_t *)userptr);
+}
+
+/**
+ * Add an upstream node
+ */
+static int gateway_add_node(struct _taulas_gateway * gateway, const char * url) {
+  struct _gateway_node * node;
+
+  if (gateway->nb_nodes == GATEWAY_MAX_NODES) {
+    t_log(Y_LOG_LEVEL_ERROR, "Too many upstream nodes, maximum is %d", GATEWAY_MAX_NODES);
+    return 0;
+  }
+  node = &gateway->nodes[gateway->nb_nodes];
+  memset(node, 0, sizeof(struct _gateway_node));
+  node->url = o_strdup(url);
+  if (node->url == NULL) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error allocating upstream node %s", url);
+    return 0;
+  }
+  gateway->nb_nodes++;
+  t_log(Y_LOG_LEVEL_INFO, "Upstream node %s", url);
+  return 1;
+}
+
+/**
+ * Create the upstream nodes from the comma separated list of urls
+ * The connection cache is shared by the gateway requests, so the connections stay alive between requests
+ */
+int init_gateway(struct _taulas_config * taulas_config) {
+  struct _taulas_gateway * gateway = &taulas_config->gateway;
+  char * urls, * url, * saveptr = NULL;
+  int ret = 1;
+
+  memset(gateway, 0, sizeof(struct _taulas_gateway));
+  if (taulas_config->upstreams == NULL) {
+    return 1;
+  }
+  if (pthread_mutex_init(&gateway->lock, NULL) != 0 || pthread_mutex_init(&gateway->share_lock, NULL) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize Mutex Lock for gateway");
+    return 0;
+  }
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK || (gateway->share = curl_share_init()) == NULL) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error initializing curl for gateway");
+    pthread_mutex_destroy(&gateway->share_lock);
+    pthread_mutex_destroy(&gateway->lock);
+    return 0;
+  }
+  curl_share_setopt(gateway->share, CURLSHOPT_LOCKFUNC, gateway_share_lock);
+  curl_share_setopt(gateway->share, CURLSHOPT_UNLOCKFUNC, gateway_share_unlock);
+  curl_share_setopt(gateway->share, CURLSHOPT_USERDATA, &gateway->share_lock);
+  if (curl_share_setopt(gateway->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error sharing curl connections, libcurl 7.57.0 or newer is required");
+    ret = 0;
+  }
+  urls = o_strdup(taulas_config->upstreams);
+  for (url = strtok_r(urls, ",", &saveptr); url != NULL && ret; url = strtok_r(NULL, ",", &saveptr)) {
+    ret = gateway_add_node(gateway, url);
+  }
+  free(urls);
+  if (!ret) {
+    clean_gateway(taulas_config);
+  }
+  return ret;
+}
+
+/**
+ * Close the connections to the upstream nodes
+ */
+void clean_gateway(struct _taulas_config * taulas_config) {
+  struct _taulas_gateway * gateway = &taulas_config->gateway;
+  unsigned int i;
+
+  if (gateway->share != NULL) {
+    for (i=0; i<gateway->nb_nodes; i++) {
+      free(gateway->nodes[i].url);
+      free(gateway->nodes[i].name);
+    }
+    curl_share_cleanup(gateway->share);
+    curl_global_cleanup();
+    pthread_mutex_destroy(&gateway->share_lock);
+    pthread_mutex_destroy(&gateway->lock);
+    gateway->share = NULL;
+    gateway->nb_nodes = 0;
+  }
+}
+
+/**
+ * End the exchange with a node with an error
+ */
+static void gateway_node_error(struct _gateway_exchange * exchange, const char * error) {
+  snprintf(exchange->error, sizeof(exchange->error), "%s", error);
+  exchange->step = GATEWAY_STEP_DONE;
+  exchange->duration = get_monotonic_ms() - exchange->start;
+}
+
+/**
+ * Send a command to a node, the request can't last after the deadline
+ */
+static void gateway_node_send(CURLM * multi, struct _gateway_exchange * exchange, const char * command, long long deadline) {
+  long long remaining = deadline - get_monotonic_ms();
+  char * url;
+
+  if (remaining <= 0) {
+    gateway_node_error(exchange, "deadline exceeded");
+    return;
+  }
+  url = msprintf("%s?command=%s", exchange->node->url, command);
+  exchange->buffer_len = 0;
+  curl_easy_setopt(exchange->curl, CURLOPT_URL, url);
+  curl_easy_setopt(exchange->curl, CURLOPT_TIMEOUT_MS, (long)remaining);
+  free(url);
+  if (curl_multi_add_handle(multi, exchange->curl) != CURLM_OK) {
+    gateway_node_error(exchange, "internal error");
+  }
+}
+
+/**
+ * Handle the end of a request to a node
+ * If the node name was asked, send the OVERVIEW command
+ */
+static void gateway_node_done(CURLM * multi, struct _gateway_exchange * exchange, CURLcode result, long long deadline) {
+  json_t * j_response;
+  long status = 0;
+  char error[64];
+
+  curl_multi_remove_handle(multi, exchange->curl);
+  if (result != CURLE_OK) {
+    gateway_node_error(exchange, result==CURLE_OPERATION_TIMEDOUT?"deadline exceeded":curl_easy_strerror(result));
+    return;
+  }
+  curl_easy_getinfo(exchange->curl, CURLINFO_RESPONSE_CODE, &status);
+  if (status != 200) {
+    snprintf(error, sizeof(error), "status %ld", status);
+    gateway_node_error(exchange, error);
+    return;
+  }
+  j_response = exchange->buffer_len?json_loads(exchange->buffer, JSON_DECODE_ANY, NULL):NULL;
+  if (j_response == NULL) {
+    gateway_node_error(exchange, "invalid response");
+  } else if (json_object_get(j_response, "error") != NULL) {
+    // An ESP8266 node sends the device errors with the status 200
+    gateway_node_error(exchange, json_is_string(json_object_get(j_response, "error"))?json_string_value(json_object_get(j_response, "error")):"invalid response");
+    json_decref(j_response);
+  } else if (exchange->step == GATEWAY_STEP_NAME) {
+    if (json_is_string(json_object_get(j_response, "value"))) {
+      exchange->name = o_strdup(json_string_value(json_object_get(j_response, "value")));
+      exchange->step = GATEWAY_STEP_OVERVIEW;
+      gateway_node_send(multi, exchange, "OVERVIEW", deadline);
+    } else {
+      gateway_node_error(exchange, "invalid name");
+    }
+    json_decref(j_response);
+  } else if (!json_is_object(json_object_get(j_response, "sensors"))) {
+    gateway_node_error(exchange, "invalid response");
+    json_decref(j_response);
+  } else {
+    exchange->j_overview = j_response;
+    exchange->step = GATEWAY_STEP_DONE;
+    exchange->duration = get_monotonic_ms() - exchange->start;
+  }
+}
+
+/**
+ * Send OVERVIEW to all the upstream nodes in parallel, the name of a node is asked first if it's unknown
+ * Each node has gateway_deadline milliseconds to answer
+ * The lock is only held to read and update the node names, so concurrent gateway requests don't wait for each other
+ * Return the merged document: nodes that answered in time and errors of the other nodes, keyed by device name
+ */
+json_t * gateway_overview(struct _taulas_config * taulas_config, int * nb_ok) {
+  struct _taulas_gateway * gateway = &taulas_config->gateway;
+  struct _gateway_exchange exchanges[GATEWAY_MAX_NODES], * exchange;
+  CURLM * multi;
+  CURLMsg * msg;
+  json_t * j_devices = json_object(), * j_node;
+  const char * key;
+  long long deadline;
+  unsigned int i, pending, nb_errors = 0;
+  int running, queued;
+
+  *nb_ok = 0;
+  memset(exchanges, 0, sizeof(exchanges));
+  pthread_mutex_lock(&gateway->lock);
+  for (i=0; i<gateway->nb_nodes; i++) {
+    exchanges[i].node = &gateway->nodes[i];
+    exchanges[i].name = o_strdup(gateway->nodes[i].name);
+  }
+  pthread_mutex_unlock(&gateway->lock);
+
+  multi = curl_multi_init();
+  if (multi != NULL) {
+    // Keep one connection alive to each node
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)gateway->nb_nodes);
+  }
+  deadline = get_monotonic_ms() + taulas_config->gateway_deadline;
+  for (i=0; i<gateway->nb_nodes; i++) {
+    exchange = &exchanges[i];
+    exchange->start = get_monotonic_ms();
+    exchange->step = exchange->name==NULL?GATEWAY_STEP_NAME:GATEWAY_STEP_OVERVIEW;
+    if (multi == NULL || (exchange->curl = curl_easy_init()) == NULL) {
+      gateway_node_error(exchange, "internal error");
+      continue;
+    }
+    curl_easy_setopt(exchange->curl, CURLOPT_SHARE, gateway->share);
+    curl_easy_setopt(exchange->curl, CURLOPT_WRITEFUNCTION, gateway_write);
+    curl_easy_setopt(exchange->curl, CURLOPT_WRITEDATA, exchange);
+    curl_easy_setopt(exchange->curl, CURLOPT_PRIVATE, exchange);
+    curl_easy_setopt(exchange->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(exchange->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    gateway_node_send(multi, exchange, exchange->name==NULL?"NAME":"OVERVIEW", deadline);
+  }
+  for (i=0, pending=0; i<gateway->nb_nodes; i++) {
+    pending += (exchanges[i].step != GATEWAY_STEP_DONE);
+  }
+  while (pending) {
+    curl_multi_perform(multi, &running);
+    while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+      if (msg->msg == CURLMSG_DONE) {
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&exchange);
+        gateway_node_done(multi, exchange, msg->data.result, deadline);
+      }
+    }
+    for (i=0, pending=0; i<gateway->nb_nodes; i++) {
+      pending += (exchanges[i].step != GATEWAY_STEP_DONE);
+    }
+    if (pending) {
+      curl_multi_wait(multi, NULL, 0, 100, NULL);
+    }
+  }
+
+  for (i=0; i<gateway->nb_nodes; i++) {
+    exchange = &exchanges[i];
+    key = exchange->name!=NULL?exchange->name:exchange->node->url;
+    if (json_object_get(j_devices, key) != NULL) {
+      // Two nodes with the same device name
+      key = exchange->node->url;
+    }
+    if (exchange->j_overview != NULL) {
+      j_node = json_pack("{sssssIso}", "url", exchange->node->url, "status", "ok", "duration_ms", (json_int_t)exchange->duration, "overview", exchange->j_overview);
+      (*nb_ok)++;
+    } else {
+      j_node = json_pack("{sssssIss}", "url", exchange->node->url, "status", "error", "duration_ms", (json_int_t)exchange->duration, "error", exchange->error);
+      t_log(Y_LOG_LEVEL_WARNING, "Upstream node error url=%s error=%s duration_ms=%lld", exchange->node->url, exchange->error, exchange->duration);
+      nb_errors++;
+    }
+    json_object_set_new(j_devices, key, j_node);
+  }
+
+  pthread_mutex_lock(&gateway->lock);
+  for (i=0; i<gateway->nb_nodes; i++) {
+    exchange = &exchanges[i];
+    if (exchange->j_overview == NULL) {
+      // The node may have been replaced, ask its name again next time
+      free(exchange->node->name);
+      exchange->node->name = NULL;
+    } else if (exchange->node->name == NULL) {
+      exchange->node->name = exchange->name;
+      exchange->name = NULL;
+    }
+  }
+  gateway->requests++;
+  gateway->node_errors += nb_errors;
+  pthread_mutex_unlock(&gateway->lock);
+
+  for (i=0; i<gateway->nb_nodes; i++) {
+    if (exchanges[i].curl != NULL) {
+      curl_easy_cleanup(exchanges[i].curl);
+    }
+    free(exchanges[i].buffer);
+    free(exchanges[i].name);
+  }
+  if (multi != NULL) {
+    curl_multi_cleanup(multi);
+  }
+  return json_pack("{sosIsI}", "devices", j_devices, "nodes", (json_int_t)gateway->nb_nodes, "ok", (json_int_t)*nb_ok);
+}
+
+/**
+ * Return the gateway counters
+ */
+json_t * gateway_stats(struct _taulas_config * taulas_config) {
+  struct _taulas_gateway * gateway = &taulas_config->gateway;
+  json_t * j_stats;
+
+  if (gateway->share == NULL) {
+    return json_null();
+  }
+  pthread_mutex_lock(&gateway->lock);
+  j_stats = json_pack("{sIsIsI}",
+                      "nodes", (json_int_t)gateway->nb_nodes,
+                      "requests", (json_int_t)gateway->requests,
+                      "node_errors", (json_int_t)gateway->node_errors);
+  pthread_mutex_unlock(&gateway->lock);
+  return j_stats;
+}
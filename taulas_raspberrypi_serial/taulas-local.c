@@ -0,0 +1,375 @@
+/**
+ * Taulas RPI Serial interface
+ *
+ * Local consumers: shared memory snapshot of the last sensor values and alert counters,
+ * and local socket to send commands without the HTTP layer
+ *
+ * Copyright 2016 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "taulas-rpi-serial.h"
+
+/**
+ * Create and map the shared memory snapshot
+ */
+int init_shm(struct _taulas_config * taulas_config) {
+  int fd;
+
+  taulas_config->shm = NULL;
+  if (taulas_config->shm_name == NULL) {
+    return 1;
+  }
+  if (pthread_mutex_init(&taulas_config->shm_lock, NULL) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize Mutex Lock for shared memory");
+    return 0;
+  }
+  fd = shm_open(taulas_config->shm_name, O_CREAT | O_RDWR, 0644);
+  if (fd == -1) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error opening shared memory %s", taulas_config->shm_name);
+    pthread_mutex_destroy(&taulas_config->shm_lock);
+    return 0;
+  }
+  if (ftruncate(fd, sizeof(struct taulas_shm_snapshot)) == -1) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error sizing shared memory %s", taulas_config->shm_name);
+    close(fd);
+    shm_unlink(taulas_config->shm_name);
+    pthread_mutex_destroy(&taulas_config->shm_lock);
+    return 0;
+  }
+  taulas_config->shm = mmap(NULL, sizeof(struct taulas_shm_snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (taulas_config->shm == MAP_FAILED) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error mapping shared memory %s", taulas_config->shm_name);
+    taulas_config->shm = NULL;
+    shm_unlink(taulas_config->shm_name);
+    pthread_mutex_destroy(&taulas_config->shm_lock);
+    return 0;
+  }
+  memset(taulas_config->shm, 0, sizeof(struct taulas_shm_snapshot));
+  taulas_config->shm->version = TAULAS_SHM_VERSION;
+  __atomic_store_n(&taulas_config->shm->magic, TAULAS_SHM_MAGIC, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**
+ * Unmap and remove the shared memory snapshot
+ */
+void clean_shm(struct _taulas_config * taulas_config) {
+  if (taulas_config->shm != NULL) {
+    munmap(taulas_config->shm, sizeof(struct taulas_shm_snapshot));
+    shm_unlink(taulas_config->shm_name);
+    pthread_mutex_destroy(&taulas_config->shm_lock);
+    taulas_config->shm = NULL;
+  }
+}
+
+/**
+ * Seqlock write helpers, shm_lock must be held
+ */
+static void shm_write_begin(struct taulas_shm_snapshot * shm) {
+  __atomic_store_n(&shm->sequence, shm->sequence+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shm_write_end(struct taulas_shm_snapshot * shm) {
+  __atomic_store_n(&shm->sequence, shm->sequence+1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Update one sensor value in the snapshot, add the sensor if needed
+ */
+static void shm_publish_value(void * data, const char * name, json_t * j_value) {
+  struct _taulas_config * taulas_config = (struct _taulas_config *)data;
+  struct taulas_shm_snapshot * shm = taulas_config->shm;
+  uint32_t i;
+  double value;
+
+  if (json_is_object(j_value)) {
+    j_value = json_object_get(j_value, "value");
+  }
+  if (json_is_number(j_value)) {
+    value = json_number_value(j_value);
+  } else if (json_is_boolean(j_value)) {
+    value = json_is_true(j_value);
+  } else {
+    return;
+  }
+  for (i=0; i<shm->nb_sensors; i++) {
+    if (0 == strncmp(shm->sensors[i].name, name, TAULAS_SHM_NAME_SIZE)) {
+      break;
+    }
+  }
+  if (i == TAULAS_SHM_MAX_SENSORS || strlen(name) >= TAULAS_SHM_NAME_SIZE) {
+    return;
+  }
+  if (i == shm->nb_sensors) {
+    strncpy(shm->sensors[i].name, name, TAULAS_SHM_NAME_SIZE-1);
+    shm->nb_sensors++;
+  }
+  shm->sensors[i].value = value;
+  shm->sensors[i].updated_ms = get_monotonic_ms();
+}
+
+/**
+ * Publish the sensor values of an OVERVIEW or a SENSOR response in the snapshot
+ */
+void shm_publish_response(struct _taulas_config * taulas_config, const char * command, json_t * j_response) {
+  if (taulas_config->shm != NULL && j_response != NULL) {
+    pthread_mutex_lock(&taulas_config->shm_lock);
+    shm_write_begin(taulas_config->shm);
+    foreach_sensor_response(command, j_response, shm_publish_value, taulas_config);
+    shm_write_end(taulas_config->shm);
+    pthread_mutex_unlock(&taulas_config->shm_lock);
+  }
+}
+
+/**
+ * Count an alert in the snapshot
+ */
+void shm_publish_alert(struct _taulas_config * taulas_config, const char * alert) {
+  struct taulas_shm_snapshot * shm = taulas_config->shm;
+  uint32_t i;
+
+  if (shm != NULL && alert != NULL && strlen(alert) < TAULAS_SHM_NAME_SIZE) {
+    pthread_mutex_lock(&taulas_config->shm_lock);
+    for (i=0; i<shm->nb_alerts; i++) {
+      if (0 == strncmp(shm->alerts[i].name, alert, TAULAS_SHM_NAME_SIZE)) {
+        break;
+      }
+    }
+    if (i < TAULAS_SHM_MAX_ALERTS) {
+      shm_write_begin(shm);
+      if (i == shm->nb_alerts) {
+        strncpy(shm->alerts[i].name, alert, TAULAS_SHM_NAME_SIZE-1);
+        shm->nb_alerts++;
+      }
+      shm->alerts[i].count++;
+      shm->alerts[i].last_ms = get_monotonic_ms();
+      shm_write_end(shm);
+    }
+    pthread_mutex_unlock(&taulas_config->shm_lock);
+  }
+}
+
+/**
+ * Wait for data on a local connection, return 0 when the program stops
+ */
+static int local_wait_readable(int fd) {
+  struct pollfd pfd;
+  int res;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (global_handler_variable == RUNNING) {
+    res = poll(&pfd, 1, 1000);
+    if (res > 0) {
+      return 1;
+    } else if (res == -1 && errno != EINTR) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Remove a connection from the list of the local clients, close and free it
+ */
+static void local_remove_client(struct _local_client * client) {
+  struct _taulas_config * taulas_config = client->taulas_config;
+  struct _local_client ** cur;
+
+  pthread_mutex_lock(&taulas_config->local_lock);
+  for (cur = &taulas_config->local_clients; *cur != NULL; cur = &(*cur)->next) {
+    if (*cur == client) {
+      *cur = client->next;
+      break;
+    }
+  }
+  close(client->fd);
+  free(client);
+  pthread_cond_signal(&taulas_config->local_cond);
+  pthread_mutex_unlock(&taulas_config->local_lock);
+}
+
+/**
+ * Local connection thread, execute commands until the client disconnects
+ */
+static void * thread_local_client(void * args) {
+  struct _local_client * client = (struct _local_client *)args;
+  struct _taulas_config * taulas_config = client->taulas_config;
+  uint32_t len;
+  uint16_t status;
+  char * command, * body;
+  json_t * j_result;
+  unsigned int retry_after;
+
+  while (local_wait_readable(client->fd) && !taulas_local_read_all(client->fd, &len, sizeof(len))) {
+    len = ntohl(len);
+    if (len == 0 || len > TAULAS_LOCAL_MAX_FRAME) {
+      t_log(Y_LOG_LEVEL_ERROR, "Local socket invalid frame length=%u", len);
+      break;
+    }
+    command = malloc(len+1);
+    if (command == NULL || taulas_local_read_all(client->fd, command, len)) {
+      free(command);
+      break;
+    }
+    command[len] = '\0';
+    status = (uint16_t)execute_command(taulas_config, command, &j_result, &retry_after);
+    free(command);
+    body = j_result!=NULL?json_dumps(j_result, JSON_COMPACT):NULL;
+    json_decref(j_result);
+    if (body == NULL) {
+      // No valid response from the device
+      status = 500;
+      body = o_strdup("null");
+      if (body == NULL) {
+        break;
+      }
+    }
+    len = htonl((uint32_t)(sizeof(status) + strlen(body)));
+    status = htons(status);
+    if (taulas_local_write_all(client->fd, &len, sizeof(len)) || taulas_local_write_all(client->fd, &status, sizeof(status)) || taulas_local_write_all(client->fd, body, strlen(body))) {
+      free(body);
+      break;
+    }
+    free(body);
+  }
+  local_remove_client(client);
+  return NULL;
+}
+
+/**
+ * Local socket thread, start a thread for each connection
+ */
+static void * thread_local_accept(void * args) {
+  struct _taulas_config * taulas_config = (struct _taulas_config *)args;
+  struct _local_client * client;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int fd;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while (local_wait_readable(taulas_config->local_fd)) {
+    fd = accept(taulas_config->local_fd, NULL, NULL);
+    if (fd == -1) {
+      continue;
+    }
+    client = malloc(sizeof(struct _local_client));
+    if (client == NULL) {
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    client->taulas_config = taulas_config;
+    pthread_mutex_lock(&taulas_config->local_lock);
+    client->next = taulas_config->local_clients;
+    taulas_config->local_clients = client;
+    pthread_mutex_unlock(&taulas_config->local_lock);
+    if (pthread_create(&thread, &attr, thread_local_client, client) != 0) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error starting local client thread");
+      local_remove_client(client);
+    }
+  }
+  pthread_attr_destroy(&attr);
+  return NULL;
+}
+
+/**
+ * Open the local socket and start accepting connections
+ */
+int init_local_socket(struct _taulas_config * taulas_config) {
+  struct sockaddr_un address;
+
+  taulas_config->local_fd = -1;
+  taulas_config->local_clients = NULL;
+  if (taulas_config->local_socket == NULL) {
+    return 1;
+  }
+  if (strlen(taulas_config->local_socket) >= sizeof(address.sun_path)) {
+    t_log(Y_LOG_LEVEL_ERROR, "Local socket path too long");
+    return 0;
+  }
+  if (pthread_mutex_init(&taulas_config->local_lock, NULL) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize Mutex Lock for local socket");
+    return 0;
+  }
+  if (pthread_cond_init(&taulas_config->local_cond, NULL) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize condition for local socket");
+    pthread_mutex_destroy(&taulas_config->local_lock);
+    return 0;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, taulas_config->local_socket, sizeof(address.sun_path)-1);
+  unlink(taulas_config->local_socket);
+  taulas_config->local_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (taulas_config->local_fd == -1 ||
+      bind(taulas_config->local_fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+      chmod(taulas_config->local_socket, 0660) == -1 ||
+      listen(taulas_config->local_fd, 16) == -1) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error opening local socket %s", taulas_config->local_socket);
+    if (taulas_config->local_fd != -1) {
+      close(taulas_config->local_fd);
+      taulas_config->local_fd = -1;
+    }
+    pthread_cond_destroy(&taulas_config->local_cond);
+    pthread_mutex_destroy(&taulas_config->local_lock);
+    return 0;
+  }
+  if (pthread_create(&taulas_config->local_thread, NULL, thread_local_accept, taulas_config) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error starting local socket thread");
+    close(taulas_config->local_fd);
+    taulas_config->local_fd = -1;
+    unlink(taulas_config->local_socket);
+    pthread_cond_destroy(&taulas_config->local_cond);
+    pthread_mutex_destroy(&taulas_config->local_lock);
+    return 0;
+  }
+  t_log(Y_LOG_LEVEL_INFO, "Local socket listening on %s", taulas_config->local_socket);
+  return 1;
+}
+
+/**
+ * Stop accepting connections and wait for the local clients to end
+ * The connections are shut down, so a client blocked in the middle of a frame doesn't delay the stop
+ * global_handler_variable must be set to another value than RUNNING before
+ */
+void stop_local_socket(struct _taulas_config * taulas_config) {
+  struct _local_client * client;
+
+  if (taulas_config->local_fd != -1) {
+    pthread_join(taulas_config->local_thread, NULL);
+    close(taulas_config->local_fd);
+    taulas_config->local_fd = -1;
+    unlink(taulas_config->local_socket);
+    pthread_mutex_lock(&taulas_config->local_lock);
+    for (client = taulas_config->local_clients; client != NULL; client = client->next) {
+      shutdown(client->fd, SHUT_RDWR);
+    }
+    while (taulas_config->local_clients != NULL) {
+      pthread_cond_wait(&taulas_config->local_cond, &taulas_config->local_lock);
+    }
+    pthread_mutex_unlock(&taulas_config->local_lock);
+    pthread_cond_destroy(&taulas_config->local_cond);
+    pthread_mutex_destroy(&taulas_config->local_lock);
+  }
+}
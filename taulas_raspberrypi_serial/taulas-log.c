@@ -0,0 +1,179 @@
+/**
+ * Taulas RPI Serial interface
+ *
+ * Asynchronous logs: messages are formatted in a lock-free ring buffer,
+ * then written by a background thread, so logging never blocks the serial I/O
+ *
+ * Copyright 2016 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdarg.h>
+
+#include "taulas-rpi-serial.h"
+
+// One message of the ring, sequence tells if the cell is free or ready to be written
+struct _log_cell {
+  unsigned long sequence;
+  unsigned long level;
+  char          message[LOG_MESSAGE_SIZE];
+};
+
+int taulas_log_level = Y_LOG_LEVEL_DEBUG;
+__thread unsigned long t_log_request_id = 0;
+
+static struct _log_cell log_ring[LOG_RING_SIZE];
+static unsigned long    log_enqueue_pos = 0;
+static unsigned long    log_dequeue_pos = 0;
+static unsigned long    log_dropped = 0;
+static int              log_running = 0;
+static pthread_t        log_thread;
+
+/**
+ * Write the messages available in the ring, return the number of messages written
+ */
+static int t_log_drain() {
+  struct _log_cell * cell;
+  int written = 0;
+
+  for (;;) {
+    cell = &log_ring[log_dequeue_pos & (LOG_RING_SIZE-1)];
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != log_dequeue_pos+1) {
+      break;
+    }
+    y_log_message(cell->level, "%s", cell->message);
+    __atomic_store_n(&cell->sequence, log_dequeue_pos+LOG_RING_SIZE, __ATOMIC_RELEASE);
+    log_dequeue_pos++;
+    written++;
+  }
+  return written;
+}
+
+/**
+ * Background writer thread
+ */
+static void * thread_log_writer(void * args) {
+  struct timespec pause = {0, LOG_WRITER_PAUSE * 1000000L};
+  unsigned long dropped, reported = 0;
+
+  while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+    if (!t_log_drain()) {
+      nanosleep(&pause, NULL);
+    }
+    dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+      y_log_message(Y_LOG_LEVEL_WARNING, "Log ring full log_dropped=%lu", dropped - reported);
+      reported = dropped;
+    }
+  }
+  t_log_drain();
+  return NULL;
+}
+
+/**
+ * Start the background writer
+ * yder logs must be initialized before
+ */
+int t_log_init(int log_level) {
+  unsigned long i;
+
+  taulas_log_level = log_level;
+  for (i=0; i<LOG_RING_SIZE; i++) {
+    log_ring[i].sequence = i;
+  }
+  log_enqueue_pos = 0;
+  log_dequeue_pos = 0;
+  __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&log_thread, NULL, thread_log_writer, NULL) != 0) {
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    y_log_message(Y_LOG_LEVEL_ERROR, "Impossible to start log writer, logs are synchronous");
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Stop the background writer after the remaining messages are written
+ * Messages logged after are written synchronously
+ */
+void t_log_close() {
+  if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+  }
+}
+
+/**
+ * Return the number of messages dropped because the ring was full
+ */
+unsigned long t_log_dropped() {
+  return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * Format a message in a free cell of the ring, drop the message if the ring is full
+ * The request id of the current thread is added as the first field
+ * Use the t_log macro, so the level is checked before calling this function
+ */
+void t_log_message(unsigned long level, const char * format, ...) {
+  struct _log_cell * cell;
+  unsigned long pos = 0, sequence;
+  long diff;
+  int len = 0;
+  va_list args;
+
+  if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+    cell = NULL;
+  } else {
+    pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+      cell = &log_ring[pos & (LOG_RING_SIZE-1)];
+      sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+      diff = (long)sequence - (long)pos;
+      if (diff == 0) {
+        if (__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          break;
+        }
+      } else if (diff < 0) {
+        __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+      } else {
+        pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  if (cell == NULL) {
+    // Writer not running, log synchronously
+    char message[LOG_MESSAGE_SIZE];
+    if (t_log_request_id) {
+      len = snprintf(message, LOG_MESSAGE_SIZE, "request_id=%lu ", t_log_request_id);
+    }
+    va_start(args, format);
+    vsnprintf(message+len, LOG_MESSAGE_SIZE-len, format, args);
+    va_end(args);
+    y_log_message(level, "%s", message);
+  } else {
+    if (t_log_request_id) {
+      len = snprintf(cell->message, LOG_MESSAGE_SIZE, "request_id=%lu ", t_log_request_id);
+    }
+    va_start(args, format);
+    vsnprintf(cell->message+len, LOG_MESSAGE_SIZE-len, format, args);
+    va_end(args);
+    cell->level = level;
+    __atomic_store_n(&cell->sequence, pos+1, __ATOMIC_RELEASE);
+  }
+}
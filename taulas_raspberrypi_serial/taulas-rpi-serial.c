@@ -22,6 +22,8 @@
 
 #include "taulas-rpi-serial.h"
 
+int global_handler_variable;
+
 /**
  * Main function
  * 
@@ -37,12 +39,26 @@ int main(int argc, char ** argv) {
   signal (SIGINT, exit_handler);
   signal (SIGTERM, exit_handler);
   signal (SIGHUP, exit_handler);
+  // A client that disconnects before its response is written must not stop the program
+  signal (SIGPIPE, SIG_IGN);
   
   taulas_config.port = PORT_DEFAULT;
   taulas_config.prefix = o_strdup(PREFIX_DEFAULT);
   taulas_config.serial_pattern = o_strdup(SERIAL_PATTERN_DEFAULT);
   taulas_config.baud = SERIAL_BAUD_DEFAULT;
   taulas_config.timeout = SERIAL_TIMEOUT_DEFAULT;
+  taulas_config.queue_size = QUEUE_SIZE_DEFAULT;
+  taulas_config.queue_deadline = QUEUE_DEADLINE_DEFAULT;
+  taulas_config.rate_limit = RATE_LIMIT_DEFAULT;
+  taulas_config.rate_burst = RATE_BURST_DEFAULT;
+  taulas_config.rules_file = NULL;
+  taulas_config.rules_interval = RULES_INTERVAL_DEFAULT;
+  taulas_config.shm_name = o_strdup(SHM_NAME_DEFAULT);
+  taulas_config.local_socket = NULL;
+  taulas_config.upstreams = NULL;
+  taulas_config.gateway_deadline = GATEWAY_DEADLINE_DEFAULT;
+  taulas_config.shm = NULL;
+  taulas_config.local_fd = -1;
 #ifdef DEBUG
   taulas_config.log_mode = Y_LOG_MODE_CONSOLE;
   taulas_config.log_level = Y_LOG_LEVEL_DEBUG;
@@ -51,52 +67,112 @@ int main(int argc, char ** argv) {
   taulas_config.log_level = Y_LOG_LEVEL_INFO;
 #endif
   taulas_config.log_file = NULL;
+  taulas_config.serial_path = NULL;
+  taulas_config.serial_fd = -1;
+  taulas_config.local_device = 0;
+  taulas_config.device_name = NULL;
+  taulas_config.alert_url = NULL;
   
   if (build_config_from_args(argc, argv, &taulas_config)) {
     y_init_logs("Taulas RPI Serial", taulas_config.log_mode, taulas_config.log_level, taulas_config.log_file, "Starting Taulas RPI Serial interface");
+    t_log_init(taulas_config.log_level);
     
-    if (detect_device_arduino(&taulas_config)) {
-      taulas_config.alert_url = NULL;
-      if (ulfius_init_instance(&instance, taulas_config.port, NULL, NULL) != U_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Error ulfius_init_instance, abort");
-      } else {
-        u_map_put(instance.default_headers, "Access-Control-Allow-Origin", "*");
+    pthread_mutexattr_init ( &mutexattr );
+    pthread_mutexattr_settype( &mutexattr, PTHREAD_MUTEX_RECURSIVE_NP );
+    if (pthread_mutex_init(&taulas_config.lock, &mutexattr) != 0) {
+      t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize Mutex Lock for serial connection");
+    }
+    pthread_mutexattr_destroy( &mutexattr );
     
-        // Endpoint list declaration
-        ulfius_add_endpoint_by_val(&instance, "GET", "/", NULL, 0, &callback_root, &taulas_config);
-        ulfius_add_endpoint_by_val(&instance, "GET", taulas_config.prefix, NULL, 0, &callback_send_command, &taulas_config);
-        ulfius_add_endpoint_by_val(&instance, "GET", taulas_config.prefix, "/alertCb", 0, &callback_get_alert_url, &taulas_config);
-
-        // default_endpoint declaration
-        ulfius_set_default_endpoint(&instance, &callback_default, &taulas_config);
-        if (ulfius_start_framework(&instance) != U_OK) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Error ulfius_start_framework, abort");
+    if (!init_admission(&taulas_config)) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error init_admission, abort");
+    } else if (!init_rules(&taulas_config)) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error init_rules, abort");
+    } else if (taulas_config.rules_file != NULL && !load_rules(&taulas_config, taulas_config.rules_file)) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error loading rules file, abort");
+      clean_rules(&taulas_config);
+    } else if (!init_shm(&taulas_config)) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error init_shm, abort");
+      clean_rules(&taulas_config);
+    } else if (!init_gateway(&taulas_config)) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error init_gateway, abort");
+      clean_shm(&taulas_config);
+      clean_rules(&taulas_config);
+    } else if (!detect_device_arduino(&taulas_config) && taulas_config.upstreams == NULL) {
+      t_log(Y_LOG_LEVEL_ERROR, "Can not connect arduino device, abort");
+      clean_gateway(&taulas_config);
+      clean_shm(&taulas_config);
+      clean_rules(&taulas_config);
+    } else {
+      if (taulas_config.device_name != NULL) {
+        taulas_config.local_device = 1;
+        connect_device_arduino(&taulas_config);
+      } else {
+        t_log(Y_LOG_LEVEL_WARNING, "No arduino device found, running as a gateway only");
+      }
+      global_handler_variable = RUNNING;
+      if (!init_supervisor_arduino(&taulas_config)) {
+        t_log(Y_LOG_LEVEL_ERROR, "Error init_supervisor_arduino, abort");
+      } else if (!init_writeback(&taulas_config)) {
+        t_log(Y_LOG_LEVEL_ERROR, "Error init_writeback, abort");
+        global_handler_variable = STOP;
+        stop_supervisor_arduino(&taulas_config);
+      } else if (!init_local_socket(&taulas_config)) {
+        t_log(Y_LOG_LEVEL_ERROR, "Error init_local_socket, abort");
+        global_handler_variable = STOP;
+        stop_writeback(&taulas_config);
+        clean_writeback(&taulas_config);
+        stop_supervisor_arduino(&taulas_config);
+      } else {
+        if (ulfius_init_instance(&instance, taulas_config.port, NULL, NULL) != U_OK) {
+          t_log(Y_LOG_LEVEL_ERROR, "Error ulfius_init_instance, abort");
         } else {
-          y_log_message(Y_LOG_LEVEL_INFO, "Program running on port %d, wait for signal to stop", taulas_config.port);
-          pthread_mutexattr_init ( &mutexattr );
-          pthread_mutexattr_settype( &mutexattr, PTHREAD_MUTEX_RECURSIVE_NP );
-          if (pthread_mutex_init(&taulas_config.lock, &mutexattr) != 0) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Impossible to initialize Mutex Lock for MariaDB connection");
+          u_map_put(instance.default_headers, "Access-Control-Allow-Origin", "*");
+      
+          // Endpoint list declaration
+          ulfius_add_endpoint_by_val(&instance, "GET", "/", NULL, 0, &callback_root, &taulas_config);
+          ulfius_add_endpoint_by_val(&instance, "GET", taulas_config.prefix, NULL, 0, &callback_send_command, &taulas_config);
+          ulfius_add_endpoint_by_val(&instance, "GET", taulas_config.prefix, "/alertCb", 0, &callback_get_alert_url, &taulas_config);
+          ulfius_add_endpoint_by_val(&instance, "GET", taulas_config.prefix, "/stats", 0, &callback_get_stats, &taulas_config);
+          if (taulas_config.upstreams != NULL) {
+            ulfius_add_endpoint_by_val(&instance, "GET", taulas_config.prefix, "/gateway", 0, &callback_gateway, &taulas_config);
           }
-          pthread_mutexattr_destroy( &mutexattr );
-          taulas_config.serial_fd = connect_device_arduino(&taulas_config);
-          global_handler_variable = RUNNING;
-          while (global_handler_variable == RUNNING) {
-            handle_alert_arduino(&taulas_config);
-            sleep(1);
+
+          // default_endpoint declaration
+          ulfius_set_default_endpoint(&instance, &callback_default, &taulas_config);
+          if (ulfius_start_framework(&instance) != U_OK) {
+            t_log(Y_LOG_LEVEL_ERROR, "Error ulfius_start_framework, abort");
+          } else {
+            t_log(Y_LOG_LEVEL_INFO, "Program running on port %d, wait for signal to stop", taulas_config.port);
+            while (global_handler_variable == RUNNING) {
+              handle_alert_arduino(&taulas_config);
+              rules_sample(&taulas_config);
+              rules_dispatch_alerts(&taulas_config);
+              sleep(1);
+            }
+            t_log(Y_LOG_LEVEL_INFO, "Exit program");
+            ulfius_stop_framework(&instance);
           }
-          y_log_message(Y_LOG_LEVEL_INFO, "Exit program");
-          close(taulas_config.serial_fd);
-          ulfius_stop_framework(&instance);
+          ulfius_clean_instance(&instance);
         }
-        ulfius_clean_instance(&instance);
+        global_handler_variable = STOP;
+        stop_writeback(&taulas_config);
+        stop_local_socket(&taulas_config);
+        clean_writeback(&taulas_config);
+        stop_supervisor_arduino(&taulas_config);
       }
-      clean_config(&taulas_config);
-      pthread_mutex_destroy(&taulas_config.lock);
-    } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Can not connect arduino device, abort");
+      if (taulas_config.serial_fd != -1) {
+        serialport_close(taulas_config.serial_fd);
+      }
+      clean_gateway(&taulas_config);
+      clean_shm(&taulas_config);
+      clean_rules(&taulas_config);
     }
+    clean_config(&taulas_config);
+    clean_admission(&taulas_config);
+    pthread_mutex_destroy(&taulas_config.lock);
     
+    t_log_close();
     y_close_logs();
   }
 
@@ -111,13 +187,23 @@ int build_config_from_args(int argc, char ** argv, struct _taulas_config * taula
   int next_option;
   char * tmp = NULL, * to_free = NULL, * one_log_mode = NULL;
 
-  const char * short_options = "p::u::s::b::t::l::m::f::h::";
+  const char * short_options = "p::u::s::b::t::q::d::r::x::c::i::g::k::w::e::l::m::f::h::";
   static const struct option long_options[]= {
     {"port", optional_argument,NULL, 'p'},
     {"url-prefix", optional_argument,NULL, 'u'},
     {"serial-pattern", optional_argument,NULL, 's'},
     {"baud", optional_argument,NULL, 'b'},
     {"timeout", optional_argument,NULL, 't'},
+    {"queue-size", optional_argument,NULL, 'q'},
+    {"queue-deadline", optional_argument,NULL, 'd'},
+    {"rate-limit", optional_argument,NULL, 'r'},
+    {"rate-burst", optional_argument,NULL, 'x'},
+    {"rules-file", optional_argument,NULL, 'c'},
+    {"rules-interval", optional_argument,NULL, 'i'},
+    {"shm-name", optional_argument,NULL, 'g'},
+    {"local-socket", optional_argument,NULL, 'k'},
+    {"upstreams", optional_argument,NULL, 'w'},
+    {"upstream-deadline", optional_argument,NULL, 'e'},
     {"log-level", optional_argument,NULL, 'l'},
     {"log-mode", optional_argument,NULL, 'm'},
     {"log-file", optional_argument,NULL, 'f'},
@@ -200,6 +286,155 @@ int build_config_from_args(int argc, char ** argv, struct _taulas_config * taula
             return 0;
           }
           break;
+        case 'q':
+          if (optarg != NULL) {
+            taulas_config->queue_size = strtol(optarg, NULL, 10);
+            if (taulas_config->queue_size < 0) {
+              fprintf(stderr, "Error, invalid queue size\n\tPlease specify a positive integer value");
+              print_help(argv[0]);
+              return 0;
+            }
+          } else {
+            fprintf(stderr, "Error, no queue size specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
+        case 'd':
+          if (optarg != NULL) {
+            taulas_config->queue_deadline = strtol(optarg, NULL, 10);
+            if (taulas_config->queue_deadline <= 0) {
+              fprintf(stderr, "Error, invalid queue deadline\n\tPlease specify a positive integer value (in milliseconds)");
+              print_help(argv[0]);
+              return 0;
+            }
+          } else {
+            fprintf(stderr, "Error, no queue deadline specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
+        case 'r':
+          if (optarg != NULL) {
+            taulas_config->rate_limit = strtol(optarg, NULL, 10);
+            if (taulas_config->rate_limit < 0) {
+              fprintf(stderr, "Error, invalid rate limit\n\tPlease specify a positive integer value (in requests per second), 0 to disable");
+              print_help(argv[0]);
+              return 0;
+            }
+          } else {
+            fprintf(stderr, "Error, no rate limit specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
+        case 'x':
+          if (optarg != NULL) {
+            taulas_config->rate_burst = strtol(optarg, NULL, 10);
+            if (taulas_config->rate_burst <= 0) {
+              fprintf(stderr, "Error, invalid rate burst\n\tPlease specify a positive integer value");
+              print_help(argv[0]);
+              return 0;
+            }
+          } else {
+            fprintf(stderr, "Error, no rate burst specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
+        case 'c':
+          if (optarg != NULL) {
+            free(taulas_config->rules_file);
+            taulas_config->rules_file = o_strdup(optarg);
+            if (taulas_config->rules_file == NULL) {
+              fprintf(stderr, "Error allocating taulas_config->rules_file, exiting\n");
+              return 0;
+            }
+          } else {
+            fprintf(stderr, "Error, no rules file specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
+        case 'i':
+          if (optarg != NULL) {
+            taulas_config->rules_interval = strtol(optarg, NULL, 10);
+            if (taulas_config->rules_interval < 0) {
+              fprintf(stderr, "Error, invalid rules interval\n\tPlease specify a positive integer value (in seconds), 0 to disable");
+              print_help(argv[0]);
+              return 0;
+            }
+          } else {
+            fprintf(stderr, "Error, no rules interval specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
+        case 'g':
+          if (optarg != NULL) {
+            free(taulas_config->shm_name);
+            if (0 == strcmp("none", optarg)) {
+              taulas_config->shm_name = NULL;
+            } else if (optarg[0] != '/' || strchr(optarg+1, '/') != NULL) {
+              fprintf(stderr, "Error, invalid shared memory name\n\tPlease specify a name starting with '/' and without other '/'");
+              taulas_config->shm_name = NULL;
+              print_help(argv[0]);
+              return 0;
+            } else {
+              taulas_config->shm_name = o_strdup(optarg);
+              if (taulas_config->shm_name == NULL) {
+                fprintf(stderr, "Error allocating taulas_config->shm_name, exiting\n");
+                return 0;
+              }
+            }
+          } else {
+            fprintf(stderr, "Error, no shared memory name specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
+        case 'k':
+          if (optarg != NULL) {
+            free(taulas_config->local_socket);
+            taulas_config->local_socket = o_strdup(optarg);
+            if (taulas_config->local_socket == NULL) {
+              fprintf(stderr, "Error allocating taulas_config->local_socket, exiting\n");
+              return 0;
+            }
+          } else {
+            fprintf(stderr, "Error, no local socket path specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
+        case 'w':
+          if (optarg != NULL) {
+            free(taulas_config->upstreams);
+            taulas_config->upstreams = o_strdup(optarg);
+            if (taulas_config->upstreams == NULL) {
+              fprintf(stderr, "Error allocating taulas_config->upstreams, exiting\n");
+              return 0;
+            }
+          } else {
+            fprintf(stderr, "Error, no upstream url specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
+        case 'e':
+          if (optarg != NULL) {
+            taulas_config->gateway_deadline = strtol(optarg, NULL, 10);
+            if (taulas_config->gateway_deadline <= 0) {
+              fprintf(stderr, "Error, invalid upstream deadline\n\tPlease specify a positive integer value (in milliseconds)");
+              print_help(argv[0]);
+              return 0;
+            }
+          } else {
+            fprintf(stderr, "Error, no upstream deadline specified\n");
+            print_help(argv[0]);
+            return 0;
+          }
+          break;
         case 'm':
           if (optarg != NULL) {
             tmp = o_strdup(optarg);
@@ -284,6 +519,16 @@ void print_help(const char * app_name) {
   printf("-s --serial-pattern: pattern to the serial file of the arduino, default '%s'\n", SERIAL_PATTERN_DEFAULT);
   printf("-b --baud: baud rate to connect to the Arduino, default %d\n", SERIAL_BAUD_DEFAULT);
   printf("-t --timeout: timeout in seconds for serial reading, default %d\n", SERIAL_TIMEOUT_DEFAULT);
+  printf("-q --queue-size: maximum number of requests waiting for the serial port, default %d\n", QUEUE_SIZE_DEFAULT);
+  printf("-d --queue-deadline: maximum time in milliseconds a request waits for the serial port, default %d\n", QUEUE_DEADLINE_DEFAULT);
+  printf("-r --rate-limit: maximum number of requests per second for one client, 0 to disable, default %d\n", RATE_LIMIT_DEFAULT);
+  printf("-x --rate-burst: maximum number of requests in a burst for one client, default %d\n", RATE_BURST_DEFAULT);
+  printf("-c --rules-file: path to the json file of the alert rules\n");
+  printf("-i --rules-interval: interval in seconds between two OVERVIEW readings to evaluate the rules, 0 to disable, default %d\n", RULES_INTERVAL_DEFAULT);
+  printf("-g --shm-name: name of the shared memory snapshot of the sensor values, 'none' to disable, default '%s'\n", SHM_NAME_DEFAULT);
+  printf("-k --local-socket: path to the local socket to send commands without HTTP, disabled by default\n");
+  printf("-w --upstreams: comma separated list of upstream taulas urls to aggregate, e.g. 'http://esp8266:858/taulas,http://rpi:8585/taulas'\n");
+  printf("-e --upstream-deadline: maximum time in milliseconds an upstream node has to answer, default %d\n", GATEWAY_DEADLINE_DEFAULT);
 #ifdef DEBUG
   printf("-l --log-level: log level for the application, values are NONE, ERROR, WARNING, INFO, DEBUG, default is 'DEBUG'\n");
   printf("-m --log-mode: log mode for the application, values are console, file or syslog, multiple values must be separated with a comma, default is 'console'\n");
@@ -302,6 +547,10 @@ void clean_config(struct _taulas_config * taulas_config) {
     free(taulas_config->prefix);
     free(taulas_config->serial_pattern);
     free(taulas_config->log_file);
+    free(taulas_config->rules_file);
+    free(taulas_config->shm_name);
+    free(taulas_config->local_socket);
+    free(taulas_config->upstreams);
     free(taulas_config->serial_path);
     free(taulas_config->device_name);
     free(taulas_config->alert_url);
@@ -312,7 +561,7 @@ void clean_config(struct _taulas_config * taulas_config) {
  * handles signal catch to exit properly when ^C is used for example
  */
 void exit_handler(int signal) {
-  y_log_message(Y_LOG_LEVEL_INFO, "Caught a stop or kill signal (%d), exiting", signal);
+  t_log(Y_LOG_LEVEL_INFO, "Caught a stop or kill signal (%d), exiting", signal);
   global_handler_variable = STOP;
 }
 
@@ -322,32 +571,28 @@ void exit_handler(int signal) {
 void handle_alert_arduino(struct _taulas_config * taulas_config) {
   char buffer[1025] = {0};
   json_t * tmp;
-  struct _u_request req;
-  int res;
   
   if (taulas_config != NULL && taulas_config->alert_url != NULL) {
     if (pthread_mutex_lock(&taulas_config->lock)) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Error getting mutex");
+      t_log(Y_LOG_LEVEL_ERROR, "Error getting mutex");
     } else {
-      serialport_read_until(taulas_config->serial_fd, buffer, READ_UNTIL, 1024, taulas_config->timeout);
-      y_log_message(Y_LOG_LEVEL_DEBUG, "Getting message: %s", buffer);
+      // The supervisor owns the device while it's disconnected
+      if (taulas_config->serial_fd != -1) {
+        if (serialport_read_until(taulas_config->serial_fd, buffer, READ_UNTIL, 1024, taulas_config->timeout) == -1) {
+          t_log(Y_LOG_LEVEL_ERROR, "Error reading serial port");
+          breaker_report_arduino(taulas_config, SERIAL_ERROR);
+        }
+      }
+      if (strlen(buffer) > 0) {
+        t_log(Y_LOG_LEVEL_DEBUG, "Serial message received device=%s message=%s", taulas_config->device_name, buffer);
+      }
       if (strlen(buffer) > 0 && strncmp(ALERT_PREFIX, buffer, strlen(ALERT_PREFIX)) == 0) {
-        y_log_message(Y_LOG_LEVEL_DEBUG, "This message is an alert");
         buffer[strlen(buffer) - 1] = '\0';
         tmp = json_loads(buffer+1, JSON_DECODE_ANY, NULL);
         if (tmp != NULL && json_is_string(json_object_get(tmp, "alert"))) {
-          y_log_message(Y_LOG_LEVEL_DEBUG, "Sending alert to angharad");
-          ulfius_init_request(&req);
-          req.http_url = msprintf("%s/%s/%s/%s/%s", taulas_config->alert_url, "benoic", taulas_config->device_name, json_string_value(json_object_get(tmp, "alert")), "elert");
-          res = ulfius_send_http_request(&req, NULL);
-          if (res != U_OK) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Error sending alert message");
-          } else {
-            y_log_message(Y_LOG_LEVEL_DEBUG, "Alert sent succesfully");
-          }
-          ulfius_clean_request(&req);
+          send_alert_arduino(taulas_config, json_string_value(json_object_get(tmp, "alert")));
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Error decoding alert message");
+          t_log(Y_LOG_LEVEL_ERROR, "Error decoding alert message");
         }
         json_decref(tmp);
       }
@@ -356,27 +601,83 @@ void handle_alert_arduino(struct _taulas_config * taulas_config) {
   }
 }
 
+/**
+ * Send an alert message to the alert url
+ * Used for the alerts sent by the device and the alerts triggered by the rules
+ */
+int send_alert_arduino(struct _taulas_config * taulas_config, const char * alert) {
+  struct _u_request req;
+  int res;
+  
+  shm_publish_alert(taulas_config, alert);
+  if (taulas_config->alert_url == NULL) {
+    t_log(Y_LOG_LEVEL_DEBUG, "No alert url, alert %s not sent", alert);
+    return 0;
+  }
+  ulfius_init_request(&req);
+  req.http_url = msprintf("%s/%s/%s/%s/%s", taulas_config->alert_url, "benoic", taulas_config->device_name, alert, "elert");
+  res = ulfius_send_http_request(&req, NULL);
+  if (res != U_OK) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error sending alert message device=%s alert=%s", taulas_config->device_name, alert);
+  } else {
+    t_log(Y_LOG_LEVEL_DEBUG, "Alert sent device=%s alert=%s", taulas_config->device_name, alert);
+  }
+  ulfius_clean_request(&req);
+  return res == U_OK;
+}
+
 /**
  * Detect if a device is available, then updates config structure
+ * The last known serial path is tried first, then the serial pattern is scanned until a device answers
  */
 int detect_device_arduino(struct _taulas_config * taulas_config) {
   int i,  to_return = 0;
   char * filename;
   
   if (taulas_config != NULL && taulas_config->serial_pattern != NULL) {
-    for (i=0; i<128; i++) {
+    if (taulas_config->serial_path != NULL) {
+      filename = o_strdup(taulas_config->serial_path);
+      to_return = probe_device_arduino(taulas_config, filename);
+      free(filename);
+    }
+    for (i=0; i<128 && !to_return; i++) {
       filename = msprintf("%s%d", taulas_config->serial_pattern, i);
-      taulas_config->serial_fd = serialport_init(filename, taulas_config->baud);
-      if (taulas_config->serial_fd != -1) {
-        serialport_flush(taulas_config->serial_fd);
-        taulas_config->device_name = get_name_arduino(taulas_config);
-        taulas_config->serial_path = o_strdup(filename);
-        if (taulas_config->device_name != NULL) {
-          to_return = 1;
+      to_return = probe_device_arduino(taulas_config, filename);
+      free(filename);
+    }
+  }
+  return to_return;
+}
+
+/**
+ * Open the serial path and ask for the device name
+ * If the device answers, updates serial path and device name in the config structure
+ * The serial port opened here is a private one, so the connected port is never used during the scan
+ */
+int probe_device_arduino(struct _taulas_config * taulas_config, const char * serial_path) {
+  int serial_fd, to_return = 0;
+  char * device_name;
+  
+  serial_fd = serialport_init(serial_path, taulas_config->baud);
+  if (serial_fd != -1) {
+    serialport_flush(serial_fd);
+    device_name = get_name_arduino(serial_fd, taulas_config->timeout);
+    serialport_close(serial_fd);
+    if (device_name != NULL) {
+      if (pthread_mutex_lock(&taulas_config->lock)) {
+        t_log(Y_LOG_LEVEL_ERROR, "Error getting mutex");
+        free(device_name);
+      } else {
+        free(taulas_config->device_name);
+        taulas_config->device_name = device_name;
+        if (taulas_config->serial_path != serial_path) {
+          free(taulas_config->serial_path);
+          taulas_config->serial_path = o_strdup(serial_path);
         }
-        serialport_close(taulas_config->serial_fd);
+        pthread_mutex_unlock(&taulas_config->lock);
+        t_log(Y_LOG_LEVEL_INFO, "Device %s found on %s", device_name, serial_path);
+        to_return = 1;
       }
-      free(filename);
     }
   }
   return to_return;
@@ -386,37 +687,52 @@ int detect_device_arduino(struct _taulas_config * taulas_config) {
  * Connect the arduino device through the serial port
  */
 int connect_device_arduino(struct _taulas_config * taulas_config) {
-  taulas_config->serial_fd = serialport_init(taulas_config->serial_path, taulas_config->baud);
-  if (taulas_config->serial_fd != -1) {
-    serialport_flush(taulas_config->serial_fd);
+  int serial_fd;
+  
+  serial_fd = serialport_init(taulas_config->serial_path, taulas_config->baud);
+  if (serial_fd != -1) {
+    serialport_flush(serial_fd);
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Error, seria not connected");
+    t_log(Y_LOG_LEVEL_ERROR, "Error, seria not connected");
   }
-  return taulas_config->serial_fd;
+  if (pthread_mutex_lock(&taulas_config->lock)) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error getting mutex");
+    if (serial_fd != -1) {
+      serialport_close(serial_fd);
+    }
+    serial_fd = -1;
+  } else {
+    taulas_config->serial_fd = serial_fd;
+    pthread_mutex_unlock(&taulas_config->lock);
+  }
+  return serial_fd;
 }
 
 /**
  * Get the name of the connected arduino
  */
-char * get_name_arduino(struct _taulas_config * taulas_config) {
+char * get_name_arduino(int serial_fd, int timeout) {
   char buffer[1025], * to_return = NULL;
   json_t * tmp;
   char * command = COMMAND_PREFIX "NAME" COMMAND_SUFFIX;
   int res;
   
-  res = serialport_write(taulas_config->serial_fd, command);
+  res = serialport_write(serial_fd, command);
   if (res == 0) {
-    serialport_read_until(taulas_config->serial_fd, buffer, READ_UNTIL, 1024, taulas_config->timeout);
-    buffer[strlen(buffer) - 1] = '\0';
-    tmp = json_loads(buffer+strlen("NAME")+2, JSON_DECODE_ANY, NULL);
-    if (tmp != NULL) {
-      to_return = o_strdup(json_string_value(json_object_get(tmp, "value")));
-      json_decref(tmp);
+    if (serialport_read_until(serial_fd, buffer, READ_UNTIL, 1024, timeout) == 0 && strlen(buffer) > strlen("NAME")+2) {
+      buffer[strlen(buffer) - 1] = '\0';
+      tmp = json_loads(buffer+strlen("NAME")+2, JSON_DECODE_ANY, NULL);
+      if (tmp != NULL) {
+        to_return = o_strdup(json_string_value(json_object_get(tmp, "value")));
+        json_decref(tmp);
+      } else {
+        t_log(Y_LOG_LEVEL_ERROR, "Error parsing response: %s", buffer);
+      }
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Error parsing response: %s", buffer);
+      t_log(Y_LOG_LEVEL_DEBUG, "No answer to command NAME");
     }
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Error sending command NAME");
+    t_log(Y_LOG_LEVEL_ERROR, "Error sending command NAME");
   }
   
   return to_return;
@@ -424,80 +740,385 @@ char * get_name_arduino(struct _taulas_config * taulas_config) {
 
 /**
  * Send a command to the arduino, then read and parse the response
+ * If the device is unavailable, return NULL immediately and set retry_after to the number of seconds
+ * before the next reconnection attempt
  */
-json_t * send_command_arduino(struct _taulas_config * taulas_config, const char * command, int retry) {
+json_t * send_command_arduino(struct _taulas_config * taulas_config, const char * command, unsigned int * retry_after) {
   char buffer[1025];
   json_t * to_return = NULL;
   char * command_save, * command_save_ptr, * command_prefix, * serial_command;
+  int res;
+  long long start;
   
+  *retry_after = 0;
   if (taulas_config != NULL && command != NULL) {
-    if (pthread_mutex_lock(&taulas_config->lock)) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Error getting mutex");
+    if (!breaker_acquire_arduino(taulas_config, retry_after)) {
+      t_log(Y_LOG_LEVEL_DEBUG, "Device unavailable command=%s retry_after=%u", command, *retry_after);
+    } else if (pthread_mutex_lock(&taulas_config->lock)) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error getting mutex");
+    } else if (taulas_config->serial_fd == -1) {
+      // Lost between breaker check and mutex
+      *retry_after = breaker_report_arduino(taulas_config, SERIAL_ERROR);
+      pthread_mutex_unlock(&taulas_config->lock);
     } else {
-      serialport_flush(taulas_config->serial_fd);
+      start = get_monotonic_ms();
+      // The port settled when it was connected, only stale input is dropped here
+      serialport_discard(taulas_config->serial_fd);
       serial_command = msprintf("%s%s%s", COMMAND_PREFIX, command, COMMAND_SUFFIX);
       if (serialport_write(taulas_config->serial_fd, serial_command) == 0) {
-        if (!serialport_read_until(taulas_config->serial_fd, buffer, READ_UNTIL, 1024, taulas_config->timeout)) {
+        res = serialport_read_until(taulas_config->serial_fd, buffer, READ_UNTIL, 1024, taulas_config->timeout);
+        t_log(Y_LOG_LEVEL_DEBUG, "Serial exchange device=%s command=%s result=%d duration_ms=%lld", taulas_config->device_name, command, res, get_monotonic_ms()-start);
+        if (!res) {
+          breaker_report_arduino(taulas_config, SERIAL_OK);
           command_save = o_strdup(command);
           command_save_ptr = command_save;
           if (command_save != NULL) {
             command_prefix = strtok(command_save, "/");
-            if (command_prefix != NULL) {
+            if (command_prefix != NULL && strlen(buffer) > strlen(command_prefix)+2) {
               buffer[strlen(buffer) - 1] = '\0';
               to_return = json_loads(buffer+strlen(command_prefix)+2*sizeof(char), JSON_DECODE_ANY, NULL);
               if (to_return == NULL) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Error parsing buffer %s", buffer+strlen(command_prefix)+2*sizeof(char));
-                y_log_message(Y_LOG_LEVEL_ERROR, "command_prefix is %s, Full buffer is %s", command_prefix, buffer);
+                t_log(Y_LOG_LEVEL_ERROR, "Error parsing buffer %s", buffer+strlen(command_prefix)+2*sizeof(char));
+                t_log(Y_LOG_LEVEL_ERROR, "command_prefix is %s, Full buffer is %s", command_prefix, buffer);
               }
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Error getting command_prefix for buffer %s", buffer);
+              t_log(Y_LOG_LEVEL_ERROR, "Error getting command_prefix for buffer %s", buffer);
             }
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Error o_strdup command for buffer %s", buffer);
+            t_log(Y_LOG_LEVEL_ERROR, "Error o_strdup command for buffer %s", buffer);
           }
           free(command_save_ptr);
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Error reading response");
+          t_log(Y_LOG_LEVEL_ERROR, "Error reading response device=%s command=%s", taulas_config->device_name, command);
+          *retry_after = breaker_report_arduino(taulas_config, res==-2?SERIAL_TIMEOUT:SERIAL_ERROR);
         }
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Error sending command");
-        if (retry) {
-          serialport_close(taulas_config->serial_fd);
-          if (detect_device_arduino(taulas_config) && connect_device_arduino(taulas_config) != -1) {
-            y_log_message(Y_LOG_LEVEL_INFO, "Reconnect arduino succesfull");
-            return send_command_arduino(taulas_config, command, 0);
-          }
-        } 
+        t_log(Y_LOG_LEVEL_ERROR, "Error sending command device=%s command=%s", taulas_config->device_name, command);
+        *retry_after = breaker_report_arduino(taulas_config, SERIAL_ERROR);
       }
       free(serial_command);
       pthread_mutex_unlock(&taulas_config->lock);
     }
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Error input parameters");
+    t_log(Y_LOG_LEVEL_ERROR, "Error input parameters");
   }
   
   return to_return;
 }
 
+/**
+ * Execute a command sent by a client
+ * Switch and dimmer values go through the write-behind queue, other commands are sent directly
+ * Without a local device, when the program runs as a gateway only, the status is 503
+ * j_result is always set, return the status to send, same values as the HTTP status
+ */
+int execute_command(struct _taulas_config * taulas_config, const char * command, json_t ** j_result, unsigned int * retry_after) {
+  char target[WRITEBACK_TARGET_SIZE];
+  int value;
+  
+  if (!taulas_config->local_device) {
+    *retry_after = 0;
+    *j_result = json_pack("{ss}", "error", "no local device");
+    return 503;
+  } else if (writeback_parse(command, target, sizeof(target), &value) != WRITEBACK_NONE) {
+    return writeback_submit(taulas_config, command, j_result, retry_after);
+  } else {
+    return execute_command_serial(taulas_config, command, j_result, retry_after);
+  }
+}
+
+/**
+ * Send a command through the admission control, then feed the rules and the shared memory snapshot
+ * with the response
+ * j_result is always set, return the status to send, same values as the HTTP status
+ */
+int execute_command_serial(struct _taulas_config * taulas_config, const char * command, json_t ** j_result, unsigned int * retry_after) {
+  int admission, status = 200;
+  
+  *retry_after = 0;
+  if ((admission = admission_enter(taulas_config, get_command_priority(command))) != ADMISSION_OK) {
+    *j_result = json_pack("{ss}", "error", admission==ADMISSION_FULL?"queue full":"queue deadline exceeded");
+    *retry_after = 1;
+    status = 503;
+  } else {
+    *j_result = send_command_arduino(taulas_config, command, retry_after);
+    admission_leave(taulas_config);
+    if (*j_result == NULL && *retry_after) {
+      // Device unavailable, fail fast and tell the client when to come back
+      *j_result = json_pack("{ss}", "error", "device unavailable");
+      status = 503;
+    } else if (json_object_get(*j_result, "error") != NULL) {
+      status = 500;
+    } else {
+      rules_feed_response(taulas_config, command, *j_result);
+      shm_publish_response(taulas_config, command, *j_result);
+    }
+  }
+  return status;
+}
+
+/**
+ * Call callback for each sensor value of an OVERVIEW or a SENSOR response
+ */
+void foreach_sensor_response(const char * command, json_t * j_response, sensor_callback callback, void * data) {
+  const char * key;
+  json_t * j_value;
+  char name[64];
+  size_t len;
+  
+  if (command == NULL || j_response == NULL) {
+    return;
+  }
+  if (0 == strncmp("OVERVIEW", command, strlen("OVERVIEW"))) {
+    json_object_foreach(json_object_get(j_response, "sensors"), key, j_value) {
+      callback(data, key, j_value);
+    }
+  } else if (0 == strncmp("SENSOR/", command, strlen("SENSOR/"))) {
+    len = strcspn(command+strlen("SENSOR/"), "/");
+    if (len < sizeof(name)) {
+      memcpy(name, command+strlen("SENSOR/"), len);
+      name[len] = '\0';
+      callback(data, name, j_response);
+    }
+  }
+}
+
+/**
+ * Return the current monotonic time in milliseconds
+ */
+long long get_monotonic_ms() {
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize the circuit breaker, then start the connection supervisor thread
+ * The breaker is closed if the device is connected, open otherwise so the supervisor connects it
+ * Nothing is started when the program runs as a gateway only
+ */
+int init_supervisor_arduino(struct _taulas_config * taulas_config) {
+  pthread_condattr_t condattr;
+  
+  if (!taulas_config->local_device) {
+    // Gateway only, no device to supervise
+    return 1;
+  }
+  if (pthread_mutex_init(&taulas_config->breaker_lock, NULL) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize Mutex Lock for circuit breaker");
+    return 0;
+  }
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  if (pthread_cond_init(&taulas_config->breaker_cond, &condattr) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize condition for circuit breaker");
+    pthread_condattr_destroy(&condattr);
+    pthread_mutex_destroy(&taulas_config->breaker_lock);
+    return 0;
+  }
+  pthread_condattr_destroy(&condattr);
+  
+  taulas_config->breaker_state = taulas_config->serial_fd!=-1?BREAKER_CLOSED:BREAKER_OPEN;
+  taulas_config->breaker_timeouts = 0;
+  taulas_config->breaker_probe = 0;
+  taulas_config->reconnect_attempts = 0;
+  taulas_config->reconnect_at = get_monotonic_ms();
+  taulas_config->jitter_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+  
+  if (pthread_create(&taulas_config->supervisor_thread, NULL, thread_supervisor_arduino, taulas_config) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to start connection supervisor");
+    pthread_cond_destroy(&taulas_config->breaker_cond);
+    pthread_mutex_destroy(&taulas_config->breaker_lock);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Wake up the connection supervisor thread and wait for it to end
+ * global_handler_variable must be set to another value than RUNNING before
+ */
+void stop_supervisor_arduino(struct _taulas_config * taulas_config) {
+  if (!taulas_config->local_device) {
+    return;
+  }
+  pthread_mutex_lock(&taulas_config->breaker_lock);
+  pthread_cond_broadcast(&taulas_config->breaker_cond);
+  pthread_mutex_unlock(&taulas_config->breaker_lock);
+  pthread_join(taulas_config->supervisor_thread, NULL);
+  pthread_cond_destroy(&taulas_config->breaker_cond);
+  pthread_mutex_destroy(&taulas_config->breaker_lock);
+}
+
+/**
+ * Connection supervisor thread
+ * When the breaker is open, scan for the device and reconnect it with a jittered exponential backoff
+ * A succesful reconnection sets the breaker half open, the next command is the probe that closes it
+ */
+void * thread_supervisor_arduino(void * args) {
+  struct _taulas_config * taulas_config = (struct _taulas_config *)args;
+  long long now, wait_ms, delay;
+  struct timespec until;
+  int connected;
+  
+  pthread_mutex_lock(&taulas_config->breaker_lock);
+  while (global_handler_variable == RUNNING) {
+    now = get_monotonic_ms();
+    if (taulas_config->breaker_state != BREAKER_OPEN || now < taulas_config->reconnect_at) {
+      // Wait for a failure report or the next attempt, wake up every second to check stop signal
+      wait_ms = 1000;
+      if (taulas_config->breaker_state == BREAKER_OPEN && taulas_config->reconnect_at - now < wait_ms) {
+        wait_ms = taulas_config->reconnect_at - now;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &until);
+      until.tv_sec += wait_ms / 1000;
+      until.tv_nsec += (wait_ms % 1000) * 1000000;
+      if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&taulas_config->breaker_cond, &taulas_config->breaker_lock, &until);
+    } else {
+      pthread_mutex_unlock(&taulas_config->breaker_lock);
+      t_log(Y_LOG_LEVEL_INFO, "Trying to reconnect arduino, attempt %u", taulas_config->reconnect_attempts+1);
+      connected = detect_device_arduino(taulas_config) && connect_device_arduino(taulas_config) != -1;
+      pthread_mutex_lock(&taulas_config->breaker_lock);
+      if (connected) {
+        t_log(Y_LOG_LEVEL_INFO, "Reconnect arduino succesfull");
+        taulas_config->breaker_state = BREAKER_HALF_OPEN;
+        taulas_config->breaker_timeouts = 0;
+        taulas_config->breaker_probe = 0;
+        taulas_config->reconnect_attempts = 0;
+      } else {
+        // Equal jitter backoff: half of the delay is fixed, the other half is random
+        delay = RECONNECT_DELAY_MAX;
+        if (taulas_config->reconnect_attempts < 16) {
+          delay = (long long)RECONNECT_DELAY_MIN << taulas_config->reconnect_attempts;
+          if (delay > RECONNECT_DELAY_MAX) {
+            delay = RECONNECT_DELAY_MAX;
+          }
+        }
+        delay = delay/2 + rand_r(&taulas_config->jitter_seed) % (delay/2 + 1);
+        taulas_config->reconnect_attempts++;
+        taulas_config->reconnect_at = get_monotonic_ms() + delay;
+        t_log(Y_LOG_LEVEL_WARNING, "Reconnect arduino failed, next attempt in %lld ms", delay);
+      }
+    }
+  }
+  pthread_mutex_unlock(&taulas_config->breaker_lock);
+  return NULL;
+}
+
+/**
+ * Check if a command can be sent to the device
+ * Closed breaker lets every command through, half open breaker lets a single probe command through
+ * If the command is rejected, retry_after is set to the number of seconds to wait
+ */
+int breaker_acquire_arduino(struct _taulas_config * taulas_config, unsigned int * retry_after) {
+  int to_return = 0;
+  long long remaining;
+  
+  pthread_mutex_lock(&taulas_config->breaker_lock);
+  if (taulas_config->breaker_state == BREAKER_CLOSED) {
+    to_return = 1;
+  } else if (taulas_config->breaker_state == BREAKER_HALF_OPEN && !taulas_config->breaker_probe) {
+    taulas_config->breaker_probe = 1;
+    to_return = 1;
+  } else if (taulas_config->breaker_state == BREAKER_HALF_OPEN) {
+    *retry_after = 1;
+  } else {
+    remaining = taulas_config->reconnect_at - get_monotonic_ms();
+    *retry_after = remaining>1000?(unsigned int)((remaining+999)/1000):1;
+  }
+  pthread_mutex_unlock(&taulas_config->breaker_lock);
+  return to_return;
+}
+
+/**
+ * Report the result of a serial exchange to the circuit breaker
+ * Read or write errors, a failed probe, or too many consecutive timeouts open the breaker,
+ * then the serial port is closed and the supervisor is woken up to reconnect the device
+ * Return the number of seconds before the next reconnection attempt if the breaker is open, 0 otherwise
+ */
+unsigned int breaker_report_arduino(struct _taulas_config * taulas_config, int result) {
+  unsigned int retry_after = 0;
+  
+  // Serial lock first, the serial port may be closed here
+  pthread_mutex_lock(&taulas_config->lock);
+  pthread_mutex_lock(&taulas_config->breaker_lock);
+  if (result == SERIAL_OK) {
+    taulas_config->breaker_timeouts = 0;
+    if (taulas_config->breaker_state == BREAKER_HALF_OPEN) {
+      t_log(Y_LOG_LEVEL_INFO, "Device %s back online", taulas_config->device_name);
+      taulas_config->breaker_state = BREAKER_CLOSED;
+    }
+    taulas_config->breaker_probe = 0;
+  } else if (taulas_config->breaker_state != BREAKER_OPEN) {
+    if (result == SERIAL_TIMEOUT) {
+      taulas_config->breaker_timeouts++;
+    }
+    if (result == SERIAL_ERROR || taulas_config->breaker_state == BREAKER_HALF_OPEN || taulas_config->breaker_timeouts >= BREAKER_TIMEOUT_THRESHOLD) {
+      t_log(Y_LOG_LEVEL_WARNING, "Device %s lost, opening circuit breaker", taulas_config->device_name);
+      taulas_config->breaker_state = BREAKER_OPEN;
+      taulas_config->breaker_probe = 0;
+      taulas_config->reconnect_attempts = 0;
+      taulas_config->reconnect_at = get_monotonic_ms();
+      if (taulas_config->serial_fd != -1) {
+        serialport_close(taulas_config->serial_fd);
+        taulas_config->serial_fd = -1;
+      }
+      pthread_cond_signal(&taulas_config->breaker_cond);
+      retry_after = 1;
+    }
+  } else {
+    retry_after = 1;
+  }
+  pthread_mutex_unlock(&taulas_config->breaker_lock);
+  pthread_mutex_unlock(&taulas_config->lock);
+  return retry_after;
+}
+
 /**
  * Callback function used to send the command to the Arduino, then send back arduino response
+ * The request goes through the client rate limiter and waits its turn in the serial port queue
  */
 int callback_send_command (const struct _u_request * request, struct _u_response * response, void * user_data) {
   struct _taulas_config * taulas_config = (struct _taulas_config *)user_data;
-  json_t * j_result;
+  json_t * j_result = NULL;
+  unsigned int retry_after = 0;
+  char * retry_after_str;
+  const char * command;
+  char target[WRITEBACK_TARGET_SIZE];
+  int status = 200, value;
+  static unsigned long request_id = 0;
+  long long start = get_monotonic_ms();
   
   if (taulas_config != NULL) {
-    j_result = send_command_arduino(taulas_config, u_map_get(request->map_url, "command"), 1);
-    if (json_object_get(j_result, "error") != NULL && ulfius_set_json_body_response(response, 500, j_result) != U_OK) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Error ulfius_set_json_body_response");
-      response->status = 500;
-    } else if (ulfius_set_json_body_response(response, 200, j_result) != U_OK) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Error ulfius_set_json_body_response");
+    t_log_request_id = __atomic_add_fetch(&request_id, 1, __ATOMIC_RELAXED);
+    command = u_map_get(request->map_url, "command");
+    // A switch or dimmer value set to a target already pending is coalesced by the write-behind queue, so it's not rate limited
+    if ((writeback_parse(command, target, sizeof(target), &value) != WRITEBACK_OK || !writeback_has_target(taulas_config, target)) &&
+        !rate_limit_client(taulas_config, request, &retry_after)) {
+      j_result = json_pack("{ss}", "error", "too many requests");
+      status = 429;
+    } else {
+      status = execute_command(taulas_config, command, &j_result, &retry_after);
+    }
+    if (retry_after) {
+      retry_after_str = msprintf("%u", retry_after);
+      u_map_put(response->map_header, "Retry-After", retry_after_str);
+      free(retry_after_str);
+    }
+    if (ulfius_set_json_body_response(response, status, j_result) != U_OK) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error ulfius_set_json_body_response");
       response->status = 500;
     }
     json_decref(j_result);
+    t_log(Y_LOG_LEVEL_DEBUG, "Request done command=%s status=%d duration_ms=%lld", command, status, get_monotonic_ms()-start);
+    t_log_request_id = 0;
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Error taulas_config is NULL");
+    t_log(Y_LOG_LEVEL_ERROR, "Error taulas_config is NULL");
     response->status = 500;
   }
   
@@ -515,7 +1136,55 @@ int callback_get_alert_url (const struct _u_request * request, struct _u_respons
       taulas_config->alert_url = strdup(u_map_get(request->map_url, "url"));
     }
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Error taulas_config is NULL");
+    t_log(Y_LOG_LEVEL_ERROR, "Error taulas_config is NULL");
+    response->status = 500;
+  }
+  
+  return U_OK;
+}
+
+/**
+ * Callback function used to get the OVERVIEW of all the upstream nodes
+ * The status is 200 if at least one node answered, 502 otherwise
+ */
+int callback_gateway (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  struct _taulas_config * taulas_config = (struct _taulas_config *)user_data;
+  json_t * j_result;
+  int nb_ok;
+  long long start = get_monotonic_ms();
+  
+  if (taulas_config != NULL) {
+    j_result = gateway_overview(taulas_config, &nb_ok);
+    if (ulfius_set_json_body_response(response, nb_ok>0?200:502, j_result) != U_OK) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error ulfius_set_json_body_response");
+      response->status = 500;
+    }
+    json_decref(j_result);
+    t_log(Y_LOG_LEVEL_DEBUG, "Gateway request done nodes_ok=%d duration_ms=%lld", nb_ok, get_monotonic_ms()-start);
+  } else {
+    t_log(Y_LOG_LEVEL_ERROR, "Error taulas_config is NULL");
+    response->status = 500;
+  }
+  
+  return U_OK;
+}
+
+/**
+ * Callback function used to get the admission control counters
+ */
+int callback_get_stats (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  struct _taulas_config * taulas_config = (struct _taulas_config *)user_data;
+  json_t * j_result;
+  
+  if (taulas_config != NULL) {
+    j_result = json_pack("{sososos{sI}}", "admission", admission_stats(taulas_config), "writeback", writeback_stats(taulas_config), "gateway", gateway_stats(taulas_config), "log", "dropped", (json_int_t)t_log_dropped());
+    if (ulfius_set_json_body_response(response, 200, j_result) != U_OK) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error ulfius_set_json_body_response");
+      response->status = 500;
+    }
+    json_decref(j_result);
+  } else {
+    t_log(Y_LOG_LEVEL_ERROR, "Error taulas_config is NULL");
     response->status = 500;
   }
   
@@ -530,15 +1199,20 @@ int callback_default (const struct _u_request * request, struct _u_response * re
   struct _taulas_config * taulas_config = (struct _taulas_config *)user_data;
   char * command_url = msprintf("/%s?command=<YOUR_COMMAND>", taulas_config->prefix);
   char * set_alert_url = msprintf("/%s/alertCb?url=<YOUR_URL_CALLBACK>", taulas_config->prefix);
-  json_t * j_result = json_pack("{ssss}", "command_url", command_url, "set_alert_url", set_alert_url);
+  char * stats_url = msprintf("/%s/stats", taulas_config->prefix);
+  json_t * j_result = json_pack("{ssssss}", "command_url", command_url, "set_alert_url", set_alert_url, "stats_url", stats_url);
   
+  if (taulas_config->upstreams != NULL) {
+    json_object_set_new(j_result, "gateway_url", json_pack("s++", "/", taulas_config->prefix, "/gateway"));
+  }
   if (ulfius_set_json_body_response(response, 404, j_result) != U_OK) {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Error ulfius_set_json_body_response");
+    t_log(Y_LOG_LEVEL_ERROR, "Error ulfius_set_json_body_response");
     response->status = 500;
   }
   json_decref(j_result);
   free(command_url);
   free(set_alert_url);
+  free(stats_url);
   return U_OK;
 }
 
@@ -550,14 +1224,19 @@ int callback_root (const struct _u_request * request, struct _u_response * respo
   struct _taulas_config * taulas_config = (struct _taulas_config *)user_data;
   char * command_url = msprintf("/%s?command=<YOUR_COMMAND>", taulas_config->prefix);
   char * set_alert_url = msprintf("/%s/alertCb?url=<YOUR_URL_CALLBACK>", taulas_config->prefix);
-  json_t * j_result = json_pack("{ssss}", "command_url", command_url, "set_alert_url", set_alert_url);
+  char * stats_url = msprintf("/%s/stats", taulas_config->prefix);
+  json_t * j_result = json_pack("{ssssss}", "command_url", command_url, "set_alert_url", set_alert_url, "stats_url", stats_url);
   
+  if (taulas_config->upstreams != NULL) {
+    json_object_set_new(j_result, "gateway_url", json_pack("s++", "/", taulas_config->prefix, "/gateway"));
+  }
   if (ulfius_set_json_body_response(response, 200, j_result) != U_OK) {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Error ulfius_set_json_body_response");
+    t_log(Y_LOG_LEVEL_ERROR, "Error ulfius_set_json_body_response");
     response->status = 500;
   }
   json_decref(j_result);
   free(command_url);
   free(set_alert_url);
+  free(stats_url);
   return U_OK;
 }
@@ -24,19 +24,25 @@
 #define __TAULAS_RPI_SERIAL_H_
 
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include <jansson.h>
 #include <signal.h>
 #include <pthread.h>
 #include <getopt.h>
+#include <errno.h>
+#include <netdb.h>
 
 #include <orcania.h>
 #include <yder.h>
 #include <ulfius.h>
+#include <curl/curl.h>
 
 #include "arduino-serial-lib.h"
+#include "taulas-client.h"
 
 // applicaation status
-int global_handler_variable;
+extern int global_handler_variable;
 
 #define RUNNING  0
 #define STOP     1
@@ -48,6 +54,13 @@ int global_handler_variable;
 #define SERIAL_PATTERN_DEFAULT "/dev/ttyACM"
 #define SERIAL_BAUD_DEFAULT    9600
 #define SERIAL_TIMEOUT_DEFAULT 3000
+#define QUEUE_SIZE_DEFAULT     16
+#define QUEUE_DEADLINE_DEFAULT 10000
+#define RATE_LIMIT_DEFAULT     5
+#define RATE_BURST_DEFAULT     10
+#define RULES_INTERVAL_DEFAULT 10
+#define SHM_NAME_DEFAULT       "/taulas"
+#define GATEWAY_DEADLINE_DEFAULT 2000
 
 // Communication constants
 #define COMMAND_PREFIX "<"
@@ -55,6 +68,237 @@ int global_handler_variable;
 #define READ_UNTIL     '>'
 #define ALERT_PREFIX   "<{\"alert\":"
 
+// Serial exchange results
+#define SERIAL_OK      0
+#define SERIAL_TIMEOUT 1
+#define SERIAL_ERROR   2
+
+// Asynchronous logs values
+#define LOG_RING_SIZE    256 // number of messages in the ring, must be a power of 2
+#define LOG_MESSAGE_SIZE 256
+#define LOG_WRITER_PAUSE 10  // milliseconds the writer waits when the ring is empty
+
+// Check the level before formatting the message
+#define t_log(level, ...) do { if ((int)(level) <= taulas_log_level) { t_log_message((level), __VA_ARGS__); } } while (0)
+
+extern int taulas_log_level;
+extern __thread unsigned long t_log_request_id;
+
+// Circuit breaker states
+#define BREAKER_CLOSED    0
+#define BREAKER_OPEN      1
+#define BREAKER_HALF_OPEN 2
+
+// Connection supervisor values
+#define BREAKER_TIMEOUT_THRESHOLD 3     // consecutive read timeouts before the device is considered lost
+#define RECONNECT_DELAY_MIN       500   // milliseconds
+#define RECONNECT_DELAY_MAX       30000 // milliseconds
+
+// Admission control values
+#define ADMISSION_OK       0
+#define ADMISSION_FULL     1
+#define ADMISSION_DEADLINE 2
+
+#define ADMISSION_PRIORITY_WRITE 0 // commands changing the device state
+#define ADMISSION_PRIORITY_READ  1 // sensor readings
+#define ADMISSION_PRIORITIES     2
+
+#define RATE_LIMIT_CLIENTS 64 // number of client addresses tracked, the least recently seen is evicted
+
+// A request waiting for the serial port
+struct _admission_waiter {
+  pthread_cond_t             cond;
+  int                        granted;
+  struct _admission_waiter * next;
+  struct _admission_waiter * prev;
+};
+
+// Token bucket of one client address
+struct _rate_bucket {
+  char      address[NI_MAXHOST];
+  double    tokens;
+  long long last_seen;
+};
+
+// Bounded priority wait queue in front of the serial port, and per client rate limiter
+struct _taulas_admission {
+  pthread_mutex_t            lock;
+  int                        busy;
+  unsigned int               depth;
+  struct _admission_waiter * head[ADMISSION_PRIORITIES];
+  struct _admission_waiter * tail[ADMISSION_PRIORITIES];
+  struct _rate_bucket        buckets[RATE_LIMIT_CLIENTS];
+  
+  // counters
+  unsigned long long         admitted;
+  unsigned long long         shed_rate_limit;
+  unsigned long long         shed_queue_full;
+  unsigned long long         shed_deadline;
+  unsigned long long         queue_time_total;
+  long long                  queue_time_max;
+};
+
+// Rules engine values
+#define RULE_MAX_CODE    64 // maximum number of operations in a rule expression
+#define RULE_MAX_STACK   16
+#define RULE_MAX_PENDING 64 // maximum number of alerts waiting to be sent
+
+#define RULE_OP_CONST  0
+#define RULE_OP_SENSOR 1
+#define RULE_OP_ADD    2
+#define RULE_OP_SUB    3
+#define RULE_OP_MUL    4
+#define RULE_OP_DIV    5
+#define RULE_OP_NEG    6
+#define RULE_OP_ABS    7
+
+#define RULE_GREATER       0
+#define RULE_GREATER_EQUAL 1
+#define RULE_LOWER         2
+#define RULE_LOWER_EQUAL   3
+
+// One operation of a compiled rule expression
+struct _rule_op {
+  int    type;
+  double value;
+  int    slot;
+};
+
+// A compiled rule and its evaluation state
+struct _rule {
+  char *            name;
+  struct _rule_op * code;
+  unsigned int      code_len;
+  int               compare;
+  double            threshold;
+  double            hysteresis;
+  int               rate;
+  
+  int               active;
+  int               dirty;
+  int               has_last;
+  double            last_value;
+  long long         last_time;
+};
+
+// Last value of a sensor used by the rules, and the rules depending on it
+struct _sensor_slot {
+  char *         name;
+  double         value;
+  int            has_value;
+  unsigned int * rules;
+  unsigned int   nb_rules;
+};
+
+// Rules engine
+struct _taulas_rules {
+  pthread_mutex_t       lock;
+  struct _rule *        rules;
+  unsigned int          nb_rules;
+  struct _sensor_slot * slots;
+  unsigned int          nb_slots;
+  unsigned int *        dirty;
+  unsigned int          nb_dirty;
+  char **               pending_alerts;
+  unsigned int          nb_pending;
+  long long             last_sample;
+};
+
+// Write-behind queue values
+#define WRITEBACK_OK      0
+#define WRITEBACK_NONE    1
+#define WRITEBACK_INVALID 2
+
+#define WRITEBACK_MAX_TARGETS 32
+#define WRITEBACK_TARGET_SIZE 32 // "SWITCH/<name>" or "DIMMER/<name>"
+
+// A switch or a dimmer, its latest value set and the last state applied
+struct _writeback_target {
+  char                       name[WRITEBACK_TARGET_SIZE];
+  int                        used;
+  int                        value;
+  int                        queued;
+  int                        sending;
+  unsigned int               waiters;
+  unsigned long              requested; // generation of the latest value set
+  unsigned long              applied;   // generation of the last value sent
+  json_t *                   j_applied; // device response for the last value sent
+  int                        status;
+  unsigned int               retry_after;
+  struct _writeback_target * next;
+};
+
+// Write-behind queue of the switches and dimmers, each target is queued at most once
+// A target slot is released when its value is sent and no caller waits for it
+struct _taulas_writeback {
+  pthread_mutex_t            lock;
+  pthread_cond_t             cond;
+  pthread_cond_t             applied_cond;
+  pthread_t                  thread;
+  int                        running;
+  struct _writeback_target   targets[WRITEBACK_MAX_TARGETS];
+  unsigned int               nb_targets;
+  struct _writeback_target * head;
+  struct _writeback_target * tail;
+  
+  // counters
+  unsigned long long         submitted;
+  unsigned long long         coalesced;
+  unsigned long long         sent;
+  unsigned long long         failed;
+};
+
+// Gateway values
+#define GATEWAY_MAX_NODES    32
+#define GATEWAY_RESPONSE_MAX 65536 // maximum size of a node response
+
+#define GATEWAY_STEP_NAME     0
+#define GATEWAY_STEP_OVERVIEW 1
+#define GATEWAY_STEP_DONE     2
+
+// An upstream taulas node, its name is kept between requests
+struct _gateway_node {
+  char *    url;
+  char *    name;
+};
+
+// The exchange with a node during one gateway request
+struct _gateway_exchange {
+  struct _gateway_node * node;
+  CURL *    curl;
+  char *    name;
+  int       step;
+  char *    buffer;
+  size_t    buffer_len;
+  long long start;
+  long long duration;
+  json_t *  j_overview;
+  char      error[64];
+};
+
+// Upstream nodes, concurrent gateway requests run in parallel and share the connections kept alive
+struct _taulas_gateway {
+  pthread_mutex_t      lock;
+  pthread_mutex_t      share_lock;
+  CURLSH *             share;
+  struct _gateway_node nodes[GATEWAY_MAX_NODES];
+  unsigned int         nb_nodes;
+  
+  // counters
+  unsigned long long   requests;
+  unsigned long long   node_errors;
+};
+
+// A connection on the local socket
+struct _local_client {
+  int                     fd;
+  struct _taulas_config * taulas_config;
+  struct _local_client  * next;
+};
+
+// Callback called for each sensor value of a response
+typedef void (* sensor_callback)(void * data, const char * name, json_t * j_value);
+
 // Configuration structure
 struct _taulas_config {
   // Config data
@@ -63,6 +307,16 @@ struct _taulas_config {
   char * serial_pattern;
   int    baud;
   int    timeout;
+  int    queue_size;
+  int    queue_deadline;
+  int    rate_limit;
+  int    rate_burst;
+  char * rules_file;
+  int    rules_interval;
+  char * shm_name;
+  char * local_socket;
+  char * upstreams;
+  int    gateway_deadline;
   int    log_mode;
   int    log_level;
   char * log_file;
@@ -70,9 +324,42 @@ struct _taulas_config {
   // working data
   char *          serial_path;
   int             serial_fd;
+  int             local_device; // 0 if the program runs as a gateway only
   char *          device_name;
   char *          alert_url;
   pthread_mutex_t lock;
+  
+  // connection supervisor and circuit breaker
+  pthread_t       supervisor_thread;
+  pthread_mutex_t breaker_lock;
+  pthread_cond_t  breaker_cond;
+  int             breaker_state;
+  int             breaker_timeouts;
+  int             breaker_probe;
+  unsigned int    reconnect_attempts;
+  long long       reconnect_at;
+  unsigned int    jitter_seed;
+  
+  // admission control
+  struct _taulas_admission admission;
+  
+  // rules engine
+  struct _taulas_rules rules;
+  
+  // write-behind queue
+  struct _taulas_writeback writeback;
+  
+  // gateway
+  struct _taulas_gateway gateway;
+  
+  // local consumers
+  struct taulas_shm_snapshot * shm;
+  pthread_mutex_t              shm_lock;
+  int                          local_fd;
+  pthread_t                    local_thread;
+  pthread_mutex_t              local_lock;
+  pthread_cond_t               local_cond;
+  struct _local_client       * local_clients;
 };
 
 // main functions
@@ -83,14 +370,75 @@ void print_help(const char * app_name);
 
 // Serial communication functions
 int detect_device_arduino(struct _taulas_config * taulas_config);
+int probe_device_arduino(struct _taulas_config * taulas_config, const char * serial_path);
 int connect_device_arduino(struct _taulas_config * taulas_config);
-char * get_name_arduino(struct _taulas_config * taulas_config);
-json_t * send_command_arduino(struct _taulas_config * taulas_config, const char * command, int retry);
+char * get_name_arduino(int serial_fd, int timeout);
+json_t * send_command_arduino(struct _taulas_config * taulas_config, const char * command, unsigned int * retry_after);
+int execute_command(struct _taulas_config * taulas_config, const char * command, json_t ** j_result, unsigned int * retry_after);
+int execute_command_serial(struct _taulas_config * taulas_config, const char * command, json_t ** j_result, unsigned int * retry_after);
+void foreach_sensor_response(const char * command, json_t * j_response, sensor_callback callback, void * data);
 void handle_alert_arduino(struct _taulas_config * taulas_config);
+int send_alert_arduino(struct _taulas_config * taulas_config, const char * alert);
+
+// Connection supervisor functions
+long long get_monotonic_ms();
+int init_supervisor_arduino(struct _taulas_config * taulas_config);
+void stop_supervisor_arduino(struct _taulas_config * taulas_config);
+void * thread_supervisor_arduino(void * args);
+int breaker_acquire_arduino(struct _taulas_config * taulas_config, unsigned int * retry_after);
+unsigned int breaker_report_arduino(struct _taulas_config * taulas_config, int result);
+
+// Asynchronous logs functions
+int t_log_init(int log_level);
+void t_log_close();
+unsigned long t_log_dropped();
+void t_log_message(unsigned long level, const char * format, ...);
+
+// Admission control functions
+int init_admission(struct _taulas_config * taulas_config);
+void clean_admission(struct _taulas_config * taulas_config);
+int get_command_priority(const char * command);
+int rate_limit_client(struct _taulas_config * taulas_config, const struct _u_request * request, unsigned int * retry_after);
+int admission_enter(struct _taulas_config * taulas_config, int priority);
+void admission_leave(struct _taulas_config * taulas_config);
+json_t * admission_stats(struct _taulas_config * taulas_config);
+
+// Rules engine functions
+int init_rules(struct _taulas_config * taulas_config);
+int load_rules(struct _taulas_config * taulas_config, const char * path);
+void clean_rules(struct _taulas_config * taulas_config);
+void rules_feed_response(struct _taulas_config * taulas_config, const char * command, json_t * j_response);
+void rules_sample(struct _taulas_config * taulas_config);
+void rules_dispatch_alerts(struct _taulas_config * taulas_config);
+
+// Write-behind queue functions
+int init_writeback(struct _taulas_config * taulas_config);
+void stop_writeback(struct _taulas_config * taulas_config);
+void clean_writeback(struct _taulas_config * taulas_config);
+int writeback_parse(const char * command, char * target, size_t target_size, int * value);
+int writeback_submit(struct _taulas_config * taulas_config, const char * command, json_t ** j_result, unsigned int * retry_after);
+int writeback_has_target(struct _taulas_config * taulas_config, const char * target);
+json_t * writeback_stats(struct _taulas_config * taulas_config);
+
+// Gateway functions
+int init_gateway(struct _taulas_config * taulas_config);
+void clean_gateway(struct _taulas_config * taulas_config);
+json_t * gateway_overview(struct _taulas_config * taulas_config, int * nb_ok);
+json_t * gateway_stats(struct _taulas_config * taulas_config);
+
+// Local consumers functions
+int init_shm(struct _taulas_config * taulas_config);
+void clean_shm(struct _taulas_config * taulas_config);
+void shm_publish_response(struct _taulas_config * taulas_config, const char * command, json_t * j_response);
+void shm_publish_alert(struct _taulas_config * taulas_config, const char * alert);
+int init_local_socket(struct _taulas_config * taulas_config);
+void stop_local_socket(struct _taulas_config * taulas_config);
 
 // Callback functions
 int callback_send_command (const struct _u_request * request, struct _u_response * response, void * user_data);
 int callback_get_alert_url (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_gateway (const struct _u_request * request, struct _u_response * response, void * user_data);
+int callback_get_stats (const struct _u_request * request, struct _u_response * response, void * user_data);
 int callback_default (const struct _u_request * request, struct _u_response * response, void * user_data);
 int callback_root (const struct _u_request * request, struct _u_response * response, void * user_data);
 
@@ -0,0 +1,584 @@
+/**
+ * Taulas RPI Serial interface
+ *
+ * Rules engine: threshold, hysteresis and rate of change alerts over sensor values
+ * or expressions of sensor values, evaluated when a new sample arrives
+ *
+ * Copyright 2016 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <ctype.h>
+#include <math.h>
+
+#include "taulas-rpi-serial.h"
+
+/**
+ * Return the index of the sensor slot, -1 if not found
+ */
+static int rules_get_slot(struct _taulas_rules * rules, const char * name) {
+  unsigned int i;
+
+  for (i=0; i<rules->nb_slots; i++) {
+    if (0 == strcmp(rules->slots[i].name, name)) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Return the index of the sensor slot, create it if not found
+ */
+static int rules_add_slot(struct _taulas_rules * rules, const char * name) {
+  struct _sensor_slot * slots;
+  int index = rules_get_slot(rules, name);
+
+  if (index == -1) {
+    slots = realloc(rules->slots, (rules->nb_slots+1)*sizeof(struct _sensor_slot));
+    if (slots != NULL) {
+      rules->slots = slots;
+      memset(&rules->slots[rules->nb_slots], 0, sizeof(struct _sensor_slot));
+      rules->slots[rules->nb_slots].name = o_strdup(name);
+      index = (int)rules->nb_slots;
+      rules->nb_slots++;
+    }
+  }
+  return index;
+}
+
+/**
+ * Precedence of an operator in the operator stack
+ */
+static int rules_precedence(char op) {
+  switch (op) {
+    case '+':
+    case '-':
+      return 1;
+    case '*':
+    case '/':
+      return 2;
+    case 'n':
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Append an operation to the rule code
+ */
+static int rules_emit(struct _rule * rule, int type, double value, int slot) {
+  if (rule->code_len >= RULE_MAX_CODE) {
+    return 0;
+  }
+  rule->code[rule->code_len].type = type;
+  rule->code[rule->code_len].value = value;
+  rule->code[rule->code_len].slot = slot;
+  rule->code_len++;
+  return 1;
+}
+
+/**
+ * Append the operator popped from the operator stack to the rule code
+ */
+static int rules_emit_operator(struct _rule * rule, char op) {
+  switch (op) {
+    case '+':
+      return rules_emit(rule, RULE_OP_ADD, 0, -1);
+    case '-':
+      return rules_emit(rule, RULE_OP_SUB, 0, -1);
+    case '*':
+      return rules_emit(rule, RULE_OP_MUL, 0, -1);
+    case '/':
+      return rules_emit(rule, RULE_OP_DIV, 0, -1);
+    case 'n':
+      return rules_emit(rule, RULE_OP_NEG, 0, -1);
+    case 'a':
+      return rules_emit(rule, RULE_OP_ABS, 0, -1);
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Compile an infix expression into the postfix code of the rule
+ * Operands are numbers and sensor names, operators are + - * / unary - and abs()
+ */
+static int rules_compile_expression(struct _taulas_rules * rules, struct _rule * rule, const char * expression) {
+  char op_stack[RULE_MAX_CODE], identifier[64];
+  int op_len = 0, expect_operand = 1, slot, depth = 0, max_depth = 0;
+  size_t len;
+  unsigned int i;
+  const char * p = expression, * next;
+  char * end;
+  double value;
+
+  while (*p) {
+    if (isspace((unsigned char)*p)) {
+      p++;
+    } else if (expect_operand) {
+      if (isdigit((unsigned char)*p) || *p == '.') {
+        value = strtod(p, &end);
+        if (!rules_emit(rule, RULE_OP_CONST, value, -1)) {
+          return 0;
+        }
+        p = end;
+        expect_operand = 0;
+      } else if (isalpha((unsigned char)*p) || *p == '_') {
+        for (len=0; isalnum((unsigned char)p[len]) || p[len] == '_'; len++);
+        if (len >= sizeof(identifier)) {
+          return 0;
+        }
+        memcpy(identifier, p, len);
+        identifier[len] = '\0';
+        p += len;
+        for (next = p; isspace((unsigned char)*next); next++);
+        if (*next == '(' && 0 == strcmp(identifier, "abs")) {
+          if (op_len >= RULE_MAX_CODE) {
+            return 0;
+          }
+          op_stack[op_len++] = 'a';
+        } else {
+          slot = rules_add_slot(rules, identifier);
+          if (slot == -1 || !rules_emit(rule, RULE_OP_SENSOR, 0, slot)) {
+            return 0;
+          }
+          expect_operand = 0;
+        }
+      } else if (*p == '-' || *p == '(') {
+        if (op_len >= RULE_MAX_CODE) {
+          return 0;
+        }
+        op_stack[op_len++] = *p=='-'?'n':'(';
+        p++;
+      } else {
+        return 0;
+      }
+    } else {
+      if (*p == '+' || *p == '-' || *p == '*' || *p == '/') {
+        while (op_len > 0 && op_stack[op_len-1] != '(' && rules_precedence(op_stack[op_len-1]) >= rules_precedence(*p)) {
+          if (!rules_emit_operator(rule, op_stack[--op_len])) {
+            return 0;
+          }
+        }
+        if (op_len >= RULE_MAX_CODE) {
+          return 0;
+        }
+        op_stack[op_len++] = *p;
+        expect_operand = 1;
+        p++;
+      } else if (*p == ')') {
+        while (op_len > 0 && op_stack[op_len-1] != '(') {
+          if (!rules_emit_operator(rule, op_stack[--op_len])) {
+            return 0;
+          }
+        }
+        if (op_len == 0) {
+          return 0;
+        }
+        op_len--;
+        if (op_len > 0 && op_stack[op_len-1] == 'a' && !rules_emit_operator(rule, op_stack[--op_len])) {
+          return 0;
+        }
+        p++;
+      } else {
+        return 0;
+      }
+    }
+  }
+  if (expect_operand) {
+    return 0;
+  }
+  while (op_len > 0) {
+    if (op_stack[op_len-1] == '(' || !rules_emit_operator(rule, op_stack[--op_len])) {
+      return 0;
+    }
+  }
+
+  // Check the code leaves exactly one value on a stack small enough
+  for (i=0; i<rule->code_len; i++) {
+    if (rule->code[i].type == RULE_OP_CONST || rule->code[i].type == RULE_OP_SENSOR) {
+      depth++;
+    } else if (rule->code[i].type != RULE_OP_NEG && rule->code[i].type != RULE_OP_ABS) {
+      depth--;
+    }
+    if (depth > max_depth) {
+      max_depth = depth;
+    }
+  }
+  return depth == 1 && max_depth <= RULE_MAX_STACK;
+}
+
+/**
+ * Compile one rule from its json definition
+ */
+static int rules_compile(struct _taulas_rules * rules, struct _rule * rule, json_t * j_rule) {
+  const char * compare = json_string_value(json_object_get(j_rule, "compare")),
+             * type = json_string_value(json_object_get(j_rule, "type")),
+             * expression = json_string_value(json_object_get(j_rule, "expression"));
+
+  memset(rule, 0, sizeof(struct _rule));
+  if (expression == NULL) {
+    expression = json_string_value(json_object_get(j_rule, "sensor"));
+  }
+  if (!json_is_string(json_object_get(j_rule, "name")) || expression == NULL || compare == NULL || !json_is_number(json_object_get(j_rule, "value"))) {
+    t_log(Y_LOG_LEVEL_ERROR, "Rule must have a name, a sensor or an expression, a compare operator and a value");
+    return 0;
+  }
+  rule->name = o_strdup(json_string_value(json_object_get(j_rule, "name")));
+  rule->threshold = json_number_value(json_object_get(j_rule, "value"));
+  rule->hysteresis = json_is_number(json_object_get(j_rule, "hysteresis"))?json_number_value(json_object_get(j_rule, "hysteresis")):0;
+
+  if (0 == strcmp(compare, ">")) {
+    rule->compare = RULE_GREATER;
+  } else if (0 == strcmp(compare, ">=")) {
+    rule->compare = RULE_GREATER_EQUAL;
+  } else if (0 == strcmp(compare, "<")) {
+    rule->compare = RULE_LOWER;
+  } else if (0 == strcmp(compare, "<=")) {
+    rule->compare = RULE_LOWER_EQUAL;
+  } else {
+    t_log(Y_LOG_LEVEL_ERROR, "Rule %s: invalid compare operator %s", rule->name, compare);
+    return 0;
+  }
+
+  if (type == NULL || 0 == strcmp(type, "threshold")) {
+    rule->rate = 0;
+  } else if (0 == strcmp(type, "rate")) {
+    rule->rate = 1;
+  } else {
+    t_log(Y_LOG_LEVEL_ERROR, "Rule %s: invalid type %s", rule->name, type);
+    return 0;
+  }
+
+  rule->code = malloc(RULE_MAX_CODE*sizeof(struct _rule_op));
+  if (rule->code == NULL || !rules_compile_expression(rules, rule, expression)) {
+    t_log(Y_LOG_LEVEL_ERROR, "Rule %s: invalid expression '%s'", rule->name, expression);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Initialize an empty rules structure
+ */
+int init_rules(struct _taulas_config * taulas_config) {
+  memset(&taulas_config->rules, 0, sizeof(struct _taulas_rules));
+  if (pthread_mutex_init(&taulas_config->rules.lock, NULL) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize Mutex Lock for rules");
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Load and compile the rules file, then build the index of the rules depending on each sensor
+ */
+int load_rules(struct _taulas_config * taulas_config, const char * path) {
+  struct _taulas_rules * rules = &taulas_config->rules;
+  json_t * j_rules, * j_rule;
+  json_error_t error;
+  size_t index;
+  unsigned int i, j, * dependent;
+  int to_return = 1;
+
+  j_rules = json_load_file(path, 0, &error);
+  if (j_rules == NULL || !json_is_array(json_object_get(j_rules, "rules"))) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error loading rules file %s: %s", path, j_rules==NULL?error.text:"no rules array");
+    json_decref(j_rules);
+    return 0;
+  }
+
+  // An empty rules array is valid, nothing is allocated since malloc(0) may return NULL
+  if (json_array_size(json_object_get(j_rules, "rules")) > 0) {
+    rules->rules = malloc(json_array_size(json_object_get(j_rules, "rules"))*sizeof(struct _rule));
+    rules->dirty = malloc(json_array_size(json_object_get(j_rules, "rules"))*sizeof(unsigned int));
+    if (rules->rules == NULL || rules->dirty == NULL) {
+      t_log(Y_LOG_LEVEL_ERROR, "Error allocating rules");
+      json_decref(j_rules);
+      return 0;
+    }
+  }
+  json_array_foreach(json_object_get(j_rules, "rules"), index, j_rule) {
+    if (!rules_compile(rules, &rules->rules[rules->nb_rules], j_rule)) {
+      free(rules->rules[rules->nb_rules].name);
+      free(rules->rules[rules->nb_rules].code);
+      to_return = 0;
+      break;
+    }
+    rules->nb_rules++;
+  }
+  json_decref(j_rules);
+
+  // Reverse index: for each sensor, the rules to evaluate when a new value arrives
+  for (i=0; to_return && i<rules->nb_rules; i++) {
+    for (j=0; j<rules->rules[i].code_len; j++) {
+      if (rules->rules[i].code[j].type == RULE_OP_SENSOR) {
+        struct _sensor_slot * slot = &rules->slots[rules->rules[i].code[j].slot];
+        if (slot->nb_rules == 0 || slot->rules[slot->nb_rules-1] != i) {
+          dependent = realloc(slot->rules, (slot->nb_rules+1)*sizeof(unsigned int));
+          if (dependent == NULL) {
+            t_log(Y_LOG_LEVEL_ERROR, "Error allocating rules index");
+            to_return = 0;
+            break;
+          }
+          slot->rules = dependent;
+          slot->rules[slot->nb_rules++] = i;
+        }
+      }
+    }
+  }
+
+  if (to_return) {
+    t_log(Y_LOG_LEVEL_INFO, "%u rules loaded over %u sensors", rules->nb_rules, rules->nb_slots);
+  }
+  return to_return;
+}
+
+/**
+ * Free the rules structure
+ */
+void clean_rules(struct _taulas_config * taulas_config) {
+  struct _taulas_rules * rules = &taulas_config->rules;
+  unsigned int i;
+
+  for (i=0; i<rules->nb_rules; i++) {
+    free(rules->rules[i].name);
+    free(rules->rules[i].code);
+  }
+  for (i=0; i<rules->nb_slots; i++) {
+    free(rules->slots[i].name);
+    free(rules->slots[i].rules);
+  }
+  for (i=0; i<rules->nb_pending; i++) {
+    free(rules->pending_alerts[i]);
+  }
+  free(rules->pending_alerts);
+  free(rules->rules);
+  free(rules->dirty);
+  free(rules->slots);
+  pthread_mutex_destroy(&rules->lock);
+}
+
+/**
+ * Run the rule code, return 0 if a sensor has no value yet
+ */
+static int rules_evaluate(struct _taulas_rules * rules, struct _rule * rule, double * result) {
+  double stack[RULE_MAX_STACK];
+  unsigned int i;
+  int sp = 0;
+
+  for (i=0; i<rule->code_len; i++) {
+    switch (rule->code[i].type) {
+      case RULE_OP_CONST:
+        stack[sp++] = rule->code[i].value;
+        break;
+      case RULE_OP_SENSOR:
+        if (!rules->slots[rule->code[i].slot].has_value) {
+          return 0;
+        }
+        stack[sp++] = rules->slots[rule->code[i].slot].value;
+        break;
+      case RULE_OP_ADD:
+        sp--;
+        stack[sp-1] += stack[sp];
+        break;
+      case RULE_OP_SUB:
+        sp--;
+        stack[sp-1] -= stack[sp];
+        break;
+      case RULE_OP_MUL:
+        sp--;
+        stack[sp-1] *= stack[sp];
+        break;
+      case RULE_OP_DIV:
+        sp--;
+        stack[sp-1] /= stack[sp];
+        break;
+      case RULE_OP_NEG:
+        stack[sp-1] = -stack[sp-1];
+        break;
+      case RULE_OP_ABS:
+        stack[sp-1] = fabs(stack[sp-1]);
+        break;
+    }
+  }
+  *result = stack[0];
+  return isfinite(*result);
+}
+
+/**
+ * Compare the value to the threshold using the rule operator
+ */
+static int rules_compare(int compare, double value, double threshold) {
+  switch (compare) {
+    case RULE_GREATER:
+      return value > threshold;
+    case RULE_GREATER_EQUAL:
+      return value >= threshold;
+    case RULE_LOWER:
+      return value < threshold;
+    case RULE_LOWER_EQUAL:
+      return value <= threshold;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Evaluate a rule, add its alert to the pending list when the condition becomes true
+ * An active rule goes back to inactive when the value crosses the threshold minus the hysteresis
+ */
+static void rules_run(struct _taulas_rules * rules, struct _rule * rule, long long now) {
+  double value, rate, threshold;
+  char ** pending;
+
+  if (!rules_evaluate(rules, rule, &value)) {
+    return;
+  }
+  if (rule->rate) {
+    // Rate of change in units per minute since the previous sample
+    if (!rule->has_last || now <= rule->last_time) {
+      rule->has_last = 1;
+      rule->last_value = value;
+      rule->last_time = now;
+      return;
+    }
+    rate = (value - rule->last_value) * 60000 / (now - rule->last_time);
+    rule->last_value = value;
+    rule->last_time = now;
+    value = rate;
+  }
+
+  if (!rule->active) {
+    if (rules_compare(rule->compare, value, rule->threshold)) {
+      rule->active = 1;
+      if (rules->nb_pending < RULE_MAX_PENDING) {
+        pending = realloc(rules->pending_alerts, (rules->nb_pending+1)*sizeof(char *));
+        if (pending != NULL) {
+          rules->pending_alerts = pending;
+          rules->pending_alerts[rules->nb_pending++] = o_strdup(rule->name);
+        }
+      } else {
+        t_log(Y_LOG_LEVEL_WARNING, "Too many pending alerts, alert %s dropped", rule->name);
+      }
+    }
+  } else {
+    if (rule->compare == RULE_GREATER || rule->compare == RULE_GREATER_EQUAL) {
+      threshold = rule->threshold - rule->hysteresis;
+    } else {
+      threshold = rule->threshold + rule->hysteresis;
+    }
+    if (!rules_compare(rule->compare, value, threshold)) {
+      rule->active = 0;
+    }
+  }
+}
+
+/**
+ * Update one sensor value and mark its rules to evaluate
+ */
+static void rules_feed_value(void * data, const char * name, json_t * j_value) {
+  struct _taulas_rules * rules = (struct _taulas_rules *)data;
+  struct _sensor_slot * slot;
+  int index = rules_get_slot(rules, name);
+  unsigned int i;
+
+  if (index == -1) {
+    return;
+  }
+  if (json_is_object(j_value)) {
+    j_value = json_object_get(j_value, "value");
+  }
+  slot = &rules->slots[index];
+  if (json_is_number(j_value)) {
+    slot->value = json_number_value(j_value);
+  } else if (json_is_boolean(j_value)) {
+    slot->value = json_is_true(j_value);
+  } else {
+    return;
+  }
+  slot->has_value = 1;
+  for (i=0; i<slot->nb_rules; i++) {
+    if (!rules->rules[slot->rules[i]].dirty) {
+      rules->rules[slot->rules[i]].dirty = 1;
+      rules->dirty[rules->nb_dirty++] = slot->rules[i];
+    }
+  }
+}
+
+/**
+ * Feed the rules with the sensor values of an OVERVIEW or a SENSOR response
+ * Only the rules depending on the updated sensors are evaluated
+ */
+void rules_feed_response(struct _taulas_config * taulas_config, const char * command, json_t * j_response) {
+  struct _taulas_rules * rules = &taulas_config->rules;
+  unsigned int i;
+  long long now;
+
+  if (rules->nb_rules == 0 || command == NULL || j_response == NULL || json_object_get(j_response, "error") != NULL) {
+    return;
+  }
+
+  now = get_monotonic_ms();
+  pthread_mutex_lock(&rules->lock);
+  foreach_sensor_response(command, j_response, rules_feed_value, rules);
+  for (i=0; i<rules->nb_dirty; i++) {
+    rules->rules[rules->dirty[i]].dirty = 0;
+    rules_run(rules, &rules->rules[rules->dirty[i]], now);
+  }
+  rules->nb_dirty = 0;
+  pthread_mutex_unlock(&rules->lock);
+}
+
+/**
+ * Send an OVERVIEW command to feed the rules if the sample interval is elapsed
+ */
+void rules_sample(struct _taulas_config * taulas_config) {
+  json_t * j_result;
+  unsigned int retry_after;
+  long long now = get_monotonic_ms();
+
+  if (taulas_config->rules.nb_rules > 0 && taulas_config->rules_interval > 0 && now - taulas_config->rules.last_sample >= (long long)taulas_config->rules_interval*1000) {
+    taulas_config->rules.last_sample = now;
+    execute_command(taulas_config, "OVERVIEW", &j_result, &retry_after);
+    json_decref(j_result);
+  }
+}
+
+/**
+ * Send the pending alerts triggered by the rules
+ */
+void rules_dispatch_alerts(struct _taulas_config * taulas_config) {
+  struct _taulas_rules * rules = &taulas_config->rules;
+  char ** pending;
+  unsigned int nb_pending, i;
+
+  pthread_mutex_lock(&rules->lock);
+  pending = rules->pending_alerts;
+  nb_pending = rules->nb_pending;
+  rules->pending_alerts = NULL;
+  rules->nb_pending = 0;
+  pthread_mutex_unlock(&rules->lock);
+
+  for (i=0; i<nb_pending; i++) {
+    t_log(Y_LOG_LEVEL_DEBUG, "Rule %s triggered", pending[i]);
+    send_alert_arduino(taulas_config, pending[i]);
+    free(pending[i]);
+  }
+  free(pending);
+}
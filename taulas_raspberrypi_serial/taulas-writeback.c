@@ -0,0 +1,339 @@
+/**
+ * Taulas RPI Serial interface
+ *
+ * Write-behind queue for the SWITCH and DIMMER commands:
+ * successive values sent to the same target are coalesced, only the latest one is sent to the device,
+ * and all the callers get the state applied
+ *
+ * Copyright 2016 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <ctype.h>
+
+#include "taulas-rpi-serial.h"
+
+/**
+ * Release the slot of a target once its value is sent and no caller waits for it,
+ * so a target that doesn't exist on the device doesn't keep a slot
+ * writeback->lock must be held
+ */
+static void writeback_release(struct _taulas_writeback * writeback, struct _writeback_target * target) {
+  if (!target->queued && !target->sending && !target->waiters) {
+    json_decref(target->j_applied);
+    memset(target, 0, sizeof(struct _writeback_target));
+    writeback->nb_targets--;
+  }
+}
+
+/**
+ * Writer thread, send the queued targets one at a time, as fast as the device answers
+ * The value sent is the latest one set when the target is dequeued
+ */
+static void * thread_writeback(void * args) {
+  struct _taulas_config * taulas_config = (struct _taulas_config *)args;
+  struct _taulas_writeback * writeback = &taulas_config->writeback;
+  struct _writeback_target * target;
+  struct timespec until;
+  char command[WRITEBACK_TARGET_SIZE+8];
+  unsigned long generation;
+  unsigned int retry_after;
+  json_t * j_result;
+  int status;
+
+  pthread_mutex_lock(&writeback->lock);
+  while (writeback->running) {
+    if (writeback->head == NULL) {
+      clock_gettime(CLOCK_MONOTONIC, &until);
+      until.tv_sec++;
+      pthread_cond_timedwait(&writeback->cond, &writeback->lock, &until);
+      continue;
+    }
+    target = writeback->head;
+    writeback->head = target->next;
+    if (writeback->head == NULL) {
+      writeback->tail = NULL;
+    }
+    target->next = NULL;
+    target->queued = 0;
+    target->sending = 1;
+    generation = target->requested;
+    snprintf(command, sizeof(command), "%s/%d", target->name, target->value);
+    pthread_mutex_unlock(&writeback->lock);
+
+    status = execute_command_serial(taulas_config, command, &j_result, &retry_after);
+
+    pthread_mutex_lock(&writeback->lock);
+    json_decref(target->j_applied);
+    target->j_applied = j_result;
+    target->status = status;
+    target->retry_after = retry_after;
+    target->applied = generation;
+    target->sending = 0;
+    writeback->sent++;
+    if (status != 200) {
+      writeback->failed++;
+    }
+    pthread_cond_broadcast(&writeback->applied_cond);
+    writeback_release(writeback, target);
+  }
+  pthread_mutex_unlock(&writeback->lock);
+  return NULL;
+}
+
+/**
+ * Initialize the write-behind queue and start the writer thread
+ */
+int init_writeback(struct _taulas_config * taulas_config) {
+  struct _taulas_writeback * writeback = &taulas_config->writeback;
+  pthread_condattr_t condattr;
+
+  memset(writeback, 0, sizeof(struct _taulas_writeback));
+  if (pthread_mutex_init(&writeback->lock, NULL) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize Mutex Lock for write-behind queue");
+    return 0;
+  }
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  if (pthread_cond_init(&writeback->cond, &condattr) != 0 || pthread_cond_init(&writeback->applied_cond, &condattr) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Impossible to initialize conditions for write-behind queue");
+    pthread_condattr_destroy(&condattr);
+    pthread_mutex_destroy(&writeback->lock);
+    return 0;
+  }
+  pthread_condattr_destroy(&condattr);
+  writeback->running = 1;
+  if (pthread_create(&writeback->thread, NULL, thread_writeback, taulas_config) != 0) {
+    t_log(Y_LOG_LEVEL_ERROR, "Error starting write-behind thread");
+    pthread_cond_destroy(&writeback->cond);
+    pthread_cond_destroy(&writeback->applied_cond);
+    pthread_mutex_destroy(&writeback->lock);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Stop the writer thread and wake up the waiting callers
+ * The values still queued are not sent
+ */
+void stop_writeback(struct _taulas_config * taulas_config) {
+  struct _taulas_writeback * writeback = &taulas_config->writeback;
+
+  pthread_mutex_lock(&writeback->lock);
+  writeback->running = 0;
+  pthread_cond_signal(&writeback->cond);
+  pthread_cond_broadcast(&writeback->applied_cond);
+  pthread_mutex_unlock(&writeback->lock);
+  pthread_join(writeback->thread, NULL);
+}
+
+/**
+ * Clean the write-behind queue, the writer must be stopped and no caller waiting
+ */
+void clean_writeback(struct _taulas_config * taulas_config) {
+  struct _taulas_writeback * writeback = &taulas_config->writeback;
+  unsigned int i;
+
+  for (i=0; i<WRITEBACK_MAX_TARGETS; i++) {
+    json_decref(writeback->targets[i].j_applied);
+  }
+  pthread_cond_destroy(&writeback->cond);
+  pthread_cond_destroy(&writeback->applied_cond);
+  pthread_mutex_destroy(&writeback->lock);
+}
+
+/**
+ * Check if the command sets a switch or a dimmer: SWITCH/<name>/<0|1> or DIMMER/<name>/<0-100>
+ * Return WRITEBACK_NONE for other commands, WRITEBACK_INVALID if the name or the value is invalid,
+ * WRITEBACK_OK and set target and value otherwise
+ */
+int writeback_parse(const char * command, char * target, size_t target_size, int * value) {
+  const char * name, * value_str;
+  char * end;
+  long max, parsed;
+  size_t len, i;
+
+  if (command == NULL) {
+    return WRITEBACK_NONE;
+  } else if (0 == strncmp("SWITCH/", command, strlen("SWITCH/"))) {
+    name = command+strlen("SWITCH/");
+    max = 1;
+  } else if (0 == strncmp("DIMMER/", command, strlen("DIMMER/"))) {
+    name = command+strlen("DIMMER/");
+    max = 100;
+  } else {
+    return WRITEBACK_NONE;
+  }
+  value_str = strchr(name, '/');
+  if (value_str == NULL) {
+    // Reading the state, not a write
+    return WRITEBACK_NONE;
+  }
+  len = value_str - command;
+  if (value_str == name || len >= target_size) {
+    return WRITEBACK_INVALID;
+  }
+  for (i=0; name+i<value_str; i++) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_') {
+      return WRITEBACK_INVALID;
+    }
+  }
+  value_str++;
+  if (!isdigit((unsigned char)*value_str)) {
+    return WRITEBACK_INVALID;
+  }
+  errno = 0;
+  parsed = strtol(value_str, &end, 10);
+  if (*end != '\0' || errno == ERANGE || parsed < 0 || parsed > max) {
+    return WRITEBACK_INVALID;
+  }
+  *value = (int)parsed;
+  memcpy(target, command, len);
+  target[len] = '\0';
+  return WRITEBACK_OK;
+}
+
+/**
+ * Return the target in use with this name, NULL if none, writeback->lock must be held
+ */
+static struct _writeback_target * writeback_find(struct _taulas_writeback * writeback, const char * name) {
+  unsigned int i;
+
+  for (i=0; i<WRITEBACK_MAX_TARGETS; i++) {
+    if (writeback->targets[i].used && 0 == strcmp(writeback->targets[i].name, name)) {
+      return &writeback->targets[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Check if a value is pending for the target, a new value set to it will be coalesced
+ */
+int writeback_has_target(struct _taulas_config * taulas_config, const char * target) {
+  struct _taulas_writeback * writeback = &taulas_config->writeback;
+  int ret;
+
+  pthread_mutex_lock(&writeback->lock);
+  ret = writeback_find(writeback, target) != NULL;
+  pthread_mutex_unlock(&writeback->lock);
+  return ret;
+}
+
+/**
+ * Set the value of a switch or a dimmer and wait until a value is applied to the target
+ * If another value is set to the same target before this one is sent, only the latest is sent,
+ * and j_result is the response of the device for the latest value
+ * Return the status to send, same values as the HTTP status
+ */
+int writeback_submit(struct _taulas_config * taulas_config, const char * command, json_t ** j_result, unsigned int * retry_after) {
+  struct _taulas_writeback * writeback = &taulas_config->writeback;
+  struct _writeback_target * target = NULL;
+  char name[WRITEBACK_TARGET_SIZE];
+  struct timespec deadline;
+  long long wait_ms;
+  unsigned long generation;
+  unsigned int i;
+  int value, res = 0, status;
+
+  *retry_after = 0;
+  if (writeback_parse(command, name, sizeof(name), &value) != WRITEBACK_OK) {
+    *j_result = json_pack("{ss}", "error", "invalid target or value");
+    return 400;
+  }
+
+  pthread_mutex_lock(&writeback->lock);
+  target = writeback_find(writeback, name);
+  if (target == NULL) {
+    for (i=0; i<WRITEBACK_MAX_TARGETS && target == NULL; i++) {
+      if (!writeback->targets[i].used) {
+        target = &writeback->targets[i];
+      }
+    }
+    if (target == NULL) {
+      pthread_mutex_unlock(&writeback->lock);
+      t_log(Y_LOG_LEVEL_ERROR, "Write-behind queue full target=%s", name);
+      *j_result = json_pack("{ss}", "error", "too many targets");
+      *retry_after = 1;
+      return 503;
+    }
+    target->used = 1;
+    strcpy(target->name, name);
+    writeback->nb_targets++;
+  }
+  writeback->submitted++;
+  if (target->queued) {
+    writeback->coalesced++;
+  } else {
+    target->queued = 1;
+    if (writeback->tail != NULL) {
+      writeback->tail->next = target;
+    } else {
+      writeback->head = target;
+    }
+    writeback->tail = target;
+    pthread_cond_signal(&writeback->cond);
+  }
+  target->value = value;
+  generation = ++target->requested;
+
+  // The write waits in the admission queue, then for the device answer
+  wait_ms = (long long)taulas_config->queue_deadline + taulas_config->timeout;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += wait_ms / 1000;
+  deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  target->waiters++;
+  while (target->applied < generation && writeback->running && res != ETIMEDOUT) {
+    res = pthread_cond_timedwait(&writeback->applied_cond, &writeback->lock, &deadline);
+  }
+  target->waiters--;
+  if (target->applied >= generation) {
+    *j_result = json_deep_copy(target->j_applied);
+    *retry_after = target->retry_after;
+    status = target->status;
+  } else {
+    *j_result = json_pack("{ss}", "error", "write pending");
+    *retry_after = 1;
+    status = 503;
+  }
+  writeback_release(writeback, target);
+  pthread_mutex_unlock(&writeback->lock);
+  t_log(Y_LOG_LEVEL_DEBUG, "Write-behind done target=%s value=%d status=%d", name, value, status);
+  return status;
+}
+
+/**
+ * Return the write-behind counters
+ */
+json_t * writeback_stats(struct _taulas_config * taulas_config) {
+  struct _taulas_writeback * writeback = &taulas_config->writeback;
+  json_t * j_stats;
+
+  pthread_mutex_lock(&writeback->lock);
+  j_stats = json_pack("{sIsIsIsIsI}",
+                      "targets", (json_int_t)writeback->nb_targets,
+                      "submitted", (json_int_t)writeback->submitted,
+                      "coalesced", (json_int_t)writeback->coalesced,
+                      "sent", (json_int_t)writeback->sent,
+                      "failed", (json_int_t)writeback->failed);
+  pthread_mutex_unlock(&writeback->lock);
+  return j_stats;
+}
@@ -8,6 +8,7 @@
  * Examples:
  * - <OVERVIEW>
  * - <SENSOR/TEMPINT0/1>
+ * - <DIMMER/DI0/42>
  * 
  * Then return the result of the command between prefix and suffix too
  * Send in the beginning of the result the command and ':'
@@ -45,25 +46,65 @@
 /**
  * Device wiring
  * This device has
- * - a DHT22 temperature and humidity sensor for indoor on pin 6
- * - a DS18B20 temperature sensor for outdoor temperature on pin 7
- * - a PIR Motion sensor on pin 2
+ * - a DHT22 temperature and humidity sensor for indoor on pin 2
+ * - a DS18B20 temperature sensor for outdoor temperature on pin 4
+ * - a PIR Motion sensor on pin 3
+ * - a light sensor on analog pin 0
+ * - a relay switch on pin 8
+ * - a dimmable led on PWM pin 9
+ * 
+ * To add a device, add it to its type table, then add its sensors to SENSOR_TABLE
+ * Switches and dimmers are declared in SWITCH_TABLE and DIMMER_TABLE
  */
-#define DHTPIN 2               // DHT temperature and humidity sensor (for inside)
-#define DHTTYPE DHT22          // the DHT sensor is a DHT22 (more accurate than the DHT11)
+#define DHT_TABLE(X) \
+  X(2, DHT22)                  // DHT temperature and humidity sensor (for inside), DHT22 is more accurate than the DHT11
 
-#define MVTPIN 3               // PIR Movement sensor
-#define MVTALERTTIMEOUT 100000 // Timeout (in milliseconds) to restart alert sending after a previous sent alert
+#define MVT_TABLE(X) \
+  X(3)                         // PIR Movement sensor
 
-#define DALLASPIN 4            // Dallas temperature sensor (for outside)
+#define LIGHT_TABLE(X) \
+  X(0)                         // Analog pin where the light sensor is plugged into
 
-#define LIGHTSENSORPIN 0       // Analog pin where the light sensor is plugged into
+#define DALLASPIN 4            // OneWire bus of the Dallas temperature sensors (for outside), sensors are read by index on the bus
+
+/**
+ * Actuator tables, X(name, pin)
+ * - name: switch or dimmer name in the Taulas protocol
+ * - pin: output pin, dimmer pins must support PWM
+ * SWITCH/<name>/<0|1> and DIMMER/<name>/<0-100> set the value, SWITCH/<name> and DIMMER/<name> read it
+ */
+#define SWITCH_TABLE(X) \
+  X(SW0, 8)
+
+#define DIMMER_TABLE(X) \
+  X(DI0, 9)
+
+#define MVTALERTTIMEOUT 100000 // Timeout (in milliseconds) to restart alert sending after a previous sent alert
+
+/**
+ * Sensor table, X(name, type, index)
+ * - name: sensor name in the Taulas protocol
+ * - type: sensor type, used to read the value
+ * - index: index of the device in its type table, or on the OneWire bus for Dallas sensors
+ * OVERVIEW lists the sensors in this order, SENSOR/<name> reads one sensor
+ */
+#define SENSOR_TABLE(X) \
+  X(TEMPINT0, SENSOR_DHT_TEMP, 0) \
+  X(HUMINT0,  SENSOR_DHT_HUM,  0) \
+  X(TEMPEXT,  SENSOR_DALLAS,   0) \
+  X(MVT0,     SENSOR_MVT,      0) \
+  X(LUM0,     SENSOR_LIGHT,    0)
+
+#define SENSOR_DHT_TEMP 0
+#define SENSOR_DHT_HUM  1
+#define SENSOR_DALLAS   2
+#define SENSOR_MVT      3
+#define SENSOR_LIGHT    4
 
 /**
  * Structures used to facilitate sensor readings
  */
 typedef struct _dhtTempHum {
-  int pin;
   float temperature;
   float humidity;
   uint32_t lastTime;
@@ -76,7 +117,66 @@ typedef struct _mvtDetect {
   bool sent;
 } mvtDetect;
 
-DHT dht(DHTPIN, DHTTYPE);
+typedef struct _actuatorDef {
+  const char * name; // in program memory
+  uint8_t pin;
+} actuatorDef;
+
+typedef struct _sensorDef {
+  const char * name; // in program memory
+  uint8_t type;
+  uint8_t index;
+} sensorDef;
+
+// Devices generated from the type tables
+#define DHT_DEVICE(pin, type) DHT(pin, type),
+DHT dhtTab[] = { DHT_TABLE(DHT_DEVICE) };
+#define DHT_COUNT (sizeof(dhtTab)/sizeof(DHT))
+
+#define MVT_DEVICE(pin) { pin, 0, 0, false },
+mvtDetect mvtDetectTab[] = { MVT_TABLE(MVT_DEVICE) };
+#define MVT_COUNT (sizeof(mvtDetectTab)/sizeof(mvtDetect))
+
+#define LIGHT_DEVICE(pin) pin,
+const uint8_t lightSensorTab[] = { LIGHT_TABLE(LIGHT_DEVICE) };
+
+dhtTempHum dhtTempHumTab[DHT_COUNT];
+
+// Sensor names and definitions generated from the sensor table, stored in program memory
+#define SENSOR_NAME(name, type, index) const char sensorName_##name[] PROGMEM = #name;
+SENSOR_TABLE(SENSOR_NAME)
+
+#define SENSOR_DEF(name, type, index) { sensorName_##name, type, index },
+const sensorDef sensorTable[] PROGMEM = { SENSOR_TABLE(SENSOR_DEF) };
+#define SENSOR_COUNT (sizeof(sensorTable)/sizeof(sensorDef))
+
+// Switch and dimmer names and definitions generated from the actuator tables, stored in program memory
+#define ACTUATOR_NAME(name, pin) const char actuatorName_##name[] PROGMEM = #name;
+SWITCH_TABLE(ACTUATOR_NAME)
+DIMMER_TABLE(ACTUATOR_NAME)
+
+#define ACTUATOR_DEF(name, pin) { actuatorName_##name, pin },
+const actuatorDef switchTable[] PROGMEM = { SWITCH_TABLE(ACTUATOR_DEF) };
+const actuatorDef dimmerTable[] PROGMEM = { DIMMER_TABLE(ACTUATOR_DEF) };
+#define SWITCH_COUNT (sizeof(switchTable)/sizeof(actuatorDef))
+#define DIMMER_COUNT (sizeof(dimmerTable)/sizeof(actuatorDef))
+
+uint8_t switchState[SWITCH_COUNT];
+uint8_t dimmerState[DIMMER_COUNT]; // 0 to 100
+
+/**
+ * Response buffer, large enough for an OVERVIEW response
+ * Each sensor takes at most "name": then a value, then a comma, each actuator "name": then 3 digits, then a comma
+ */
+#define VALUE_MAX_LENGTH 8
+#define SENSOR_RESPONSE_SIZE(name, type, index) + sizeof(#name) + 3 + VALUE_MAX_LENGTH
+#define ACTUATOR_RESPONSE_SIZE(name, pin) + sizeof(#name) + 3 + 3
+#define OVERVIEW_SIZE (sizeof("<OVERVIEW:{\"sensors\":{},\"switches\":{},\"dimmers\":{}}>") SENSOR_TABLE(SENSOR_RESPONSE_SIZE) SWITCH_TABLE(ACTUATOR_RESPONSE_SIZE) DIMMER_TABLE(ACTUATOR_RESPONSE_SIZE))
+#define COMMAND_RESPONSE_SIZE 64
+#define RESPONSE_SIZE (OVERVIEW_SIZE>COMMAND_RESPONSE_SIZE?OVERVIEW_SIZE:COMMAND_RESPONSE_SIZE)
+
+char   response[RESPONSE_SIZE];
+size_t responseLength = 0;
 
 // Setup a oneWire instance to communicate with any OneWire devices 
 // (not just Maxim/Dallas temperature ICs)
@@ -100,19 +200,15 @@ boolean commandSentBack = false;   // If true, the full command is sent back in
 char prefix = '<';
 char suffix = '>';
 
-// Sensors global variables
-dhtTempHum dhtTempHumTab[1];
-
-mvtDetect mvtDetectTab[1];
-
-int lightSensorTab[1];
-
 /**
  * Returns the Dallas sensor temperature
+ * if request is false, use the temperatures requested before
  */
-float getDallasTemp() {
-  sensors.requestTemperatures();
-  return sensors.getTempCByIndex(0);
+float getDallasTemp(int index, boolean request) {
+  if (request) {
+    sensors.requestTemperatures();
+  }
+  return sensors.getTempCByIndex(index);
 }
 
 /**
@@ -139,8 +235,8 @@ float getDhtHum(int index) {
  * Updates the DHT sensor values
  */
 boolean updateDht(int index) {
-  dhtTempHumTab[index].temperature = dht.readTemperature();
-  dhtTempHumTab[index].humidity = dht.readHumidity();
+  dhtTempHumTab[index].temperature = dhtTab[index].readTemperature();
+  dhtTempHumTab[index].humidity = dhtTab[index].readHumidity();
   dhtTempHumTab[index].lastTime = millis();
   return true;
 }
@@ -159,33 +255,241 @@ float getLight(int index) {
   return analogRead(lightSensorTab[index]);
 }
 
+/**
+ * Read a sensor value depending on its type
+ * if dallasRequest is false, Dallas temperatures have already been requested
+ */
+float readSensor(uint8_t type, uint8_t index, boolean dallasRequest) {
+  switch (type) {
+    case SENSOR_DHT_TEMP:
+      return getDhtTemp(index);
+    case SENSOR_DHT_HUM:
+      return getDhtHum(index);
+    case SENSOR_DALLAS:
+      return getDallasTemp(index, dallasRequest);
+    case SENSOR_MVT:
+      return mvtDetected(index);
+    case SENSOR_LIGHT:
+      return getLight(index);
+    default:
+      return NAN;
+  }
+}
+
+/**
+ * Number of decimals sent for a sensor type
+ */
+uint8_t sensorDecimals(uint8_t type) {
+  return (type == SENSOR_MVT || type == SENSOR_LIGHT)?0:1;
+}
+
+/**
+ * Return the index in the sensor table of the sensor name, -1 if not found
+ */
+int findSensor(const char * name) {
+  for (uint8_t i=0; i<SENSOR_COUNT; i++) {
+    if (strcmp_P(name, (PGM_P)pgm_read_word(&sensorTable[i].name)) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Return the index in the actuator table of the switch or dimmer name, -1 if not found
+ */
+int findActuator(const actuatorDef * table, uint8_t count, const char * name) {
+  for (uint8_t i=0; i<count; i++) {
+    if (strcmp_P(name, (PGM_P)pgm_read_word(&table[i].name)) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Set the output of a switch or a dimmer
+ */
+void applySwitch(uint8_t index) {
+  digitalWrite(pgm_read_byte(&switchTable[index].pin), switchState[index]?HIGH:LOW);
+}
+
+void applyDimmer(uint8_t index) {
+  analogWrite(pgm_read_byte(&dimmerTable[index].pin), ((uint16_t)dimmerState[index]*255)/100);
+}
+
+/**
+ * Response buffer functions
+ * The response is built in the buffer, then sent with a single write
+ * The last byte is kept for the suffix
+ */
+void responseAppendChar(char c) {
+  if (responseLength < RESPONSE_SIZE-1) {
+    response[responseLength++] = c;
+  }
+}
+
+void responseAppend(const char * str) {
+  while (*str && responseLength < RESPONSE_SIZE-1) {
+    response[responseLength++] = *str++;
+  }
+}
+
+void responseAppend_P(PGM_P str) {
+  char c;
+  while ((c = pgm_read_byte(str++)) && responseLength < RESPONSE_SIZE-1) {
+    response[responseLength++] = c;
+  }
+}
+
+void responseAppendValue(float value, uint8_t decimals) {
+  char buffer[VALUE_MAX_LENGTH+8];
+  if (isnan(value)) {
+    responseAppend_P(PSTR("null"));
+  } else {
+    responseAppend(dtostrf(value, 1, decimals, buffer));
+  }
+}
+
+/**
+ * Append a json object of the switch or dimmer values, key is the beginning of the object
+ */
+void responseAppendActuators(PGM_P key, const actuatorDef * table, uint8_t count, const uint8_t * state) {
+  responseAppend_P(key);
+  for (uint8_t i=0; i<count; i++) {
+    if (i > 0) {
+      responseAppendChar(',');
+    }
+    responseAppendChar('"');
+    responseAppend_P((PGM_P)pgm_read_word(&table[i].name));
+    responseAppend_P(PSTR("\":"));
+    responseAppendValue(state[i], 0);
+  }
+  responseAppendChar('}');
+}
+
+/**
+ * Start a response with the prefix and the command
+ */
+void responseStart(const char * command) {
+  responseLength = 0;
+  responseAppendChar(prefix);
+  if (command != NULL) {
+    responseAppend(command);
+    responseAppendChar(':');
+  }
+}
+
+/**
+ * End the response with the suffix and send it
+ */
+void responseSend() {
+  response[responseLength++] = suffix;
+  Serial.write((const uint8_t *)response, responseLength);
+}
+
 /**
  * Send OVERVIEW result
- * if refresh is true, force refresh of the readings
+ * Dallas temperatures are requested once for all the sensors on the bus
  */
 void overview() {
+  sensorDef def;
   
-  updateDht(0);
-
-  Serial.print(prefix);
-  Serial.print("OVERVIEW:{\"sensors\":{");
-  Serial.print("\"TEMPINT0\":");
-  Serial.print(dhtTempHumTab[0].temperature, 1);
+  sensors.requestTemperatures();
+  responseStart("OVERVIEW");
+  responseAppend_P(PSTR("{\"sensors\":{"));
+  for (uint8_t i=0; i<SENSOR_COUNT; i++) {
+    memcpy_P(&def, &sensorTable[i], sizeof(sensorDef));
+    if (i > 0) {
+      responseAppendChar(',');
+    }
+    responseAppendChar('"');
+    responseAppend_P(def.name);
+    responseAppend_P(PSTR("\":"));
+    responseAppendValue(readSensor(def.type, def.index, false), sensorDecimals(def.type));
+  }
+  responseAppendChar('}');
+  responseAppendActuators(PSTR(",\"switches\":{"), switchTable, SWITCH_COUNT, switchState);
+  responseAppendActuators(PSTR(",\"dimmers\":{"), dimmerTable, DIMMER_COUNT, dimmerState);
+  responseAppendChar('}');
+  responseSend();
+}
 
-  Serial.print(",\"HUMINT0\":");
-  Serial.print(dhtTempHumTab[0].humidity, 1);
-  
-  Serial.print(",\"TEMPEXT\":");
-  Serial.print(getDallasTemp(), 1);
+/**
+ * Parse an actuator value made of digits only, between 0 and max
+ * Return false if the value is empty, has another character or is above max
+ */
+boolean parseValue(const char * value, uint8_t max, uint8_t * result) {
+  uint16_t parsed = 0;
   
-  Serial.print(",\"MVT0\":");
-  Serial.print(mvtDetected(0), 1);
+  if (*value == '\0') {
+    return false;
+  }
+  for (; *value != '\0'; value++) {
+    if (*value < '0' || *value > '9') {
+      return false;
+    }
+    parsed = parsed*10 + (*value - '0');
+    if (parsed > max) {
+      return false;
+    }
+  }
+  *result = parsed;
+  return true;
+}
+
+/**
+ * Send SWITCH or DIMMER result for the actuator name
+ * If a value is given, the actuator is set first, the result is the value applied
+ */
+void actuator(const char * command, const char * name, const char * value) {
+  boolean dimmer = (strcmp(command, "DIMMER") == 0);
+  const actuatorDef * table = dimmer?dimmerTable:switchTable;
+  uint8_t * state = dimmer?dimmerState:switchState;
+  int index = findActuator(table, dimmer?DIMMER_COUNT:SWITCH_COUNT, name);
+  uint8_t newValue;
   
-  Serial.print(",\"LUM0\":");
-  Serial.print(getLight(LIGHTSENSORPIN), 1);
+  responseStart(command);
+  if (index == -1) {
+    responseAppend_P(dimmer?PSTR("{\"error\":\"dimmer not found\"}"):PSTR("{\"error\":\"switch not found\"}"));
+  } else {
+    if (value != NULL) {
+      if (!parseValue(value, dimmer?100:1, &newValue)) {
+        responseAppend_P(PSTR("{\"error\":\"invalid value\"}"));
+        responseSend();
+        return;
+      }
+      state[index] = newValue;
+      if (dimmer) {
+        applyDimmer(index);
+      } else {
+        applySwitch(index);
+      }
+    }
+    responseAppend_P(PSTR("{\"value\":"));
+    responseAppendValue(state[index], 0);
+    responseAppendChar('}');
+  }
+  responseSend();
+}
+
+/**
+ * Send SENSOR result for the sensor name
+ */
+void sensor(const char * command, const char * name) {
+  sensorDef def;
+  int index = findSensor(name);
   
-  Serial.print("}}");
-  Serial.print(suffix);
+  responseStart(command);
+  if (index != -1) {
+    memcpy_P(&def, &sensorTable[index], sizeof(sensorDef));
+    responseAppend_P(PSTR("{\"value\":"));
+    responseAppendValue(readSensor(def.type, def.index, true), sensorDecimals(def.type));
+    responseAppendChar('}');
+  } else {
+    responseAppend_P(PSTR("{\"error\":\"sensor not found\"}"));
+  }
+  responseSend();
 }
 
 /**
@@ -221,17 +525,25 @@ void setup(void) {
   // Start up the sensor library (for external temperature)
   sensors.begin();
   
-  dhtTempHumTab[0].pin = DHTPIN;
-  pinMode(DHTPIN, INPUT);
+  for (uint8_t i=0; i<DHT_COUNT; i++) {
+    dhtTab[i].begin();
+    updateDht(i);
+  }
 
-  mvtDetectTab[0].pin = MVTPIN;
-  pinMode(MVTPIN, INPUT);
-  mvtDetectTab[0].lastDetect = millis();
+  for (uint8_t i=0; i<MVT_COUNT; i++) {
+    pinMode(mvtDetectTab[i].pin, INPUT);
+    mvtDetectTab[i].lastDetect = millis();
+  }
   
-  dht.begin();
-  updateDht(0);
-
-  lightSensorTab[0] = LIGHTSENSORPIN;
+  for (uint8_t i=0; i<SWITCH_COUNT; i++) {
+    pinMode(pgm_read_byte(&switchTable[i].pin), OUTPUT);
+    applySwitch(i);
+  }
+  
+  for (uint8_t i=0; i<DIMMER_COUNT; i++) {
+    pinMode(pgm_read_byte(&dimmerTable[i].pin), OUTPUT);
+    applyDimmer(i);
+  }
   
   pinMode(DALLASPIN, INPUT);
 }
@@ -242,79 +554,40 @@ void setup(void) {
  */
 void loop(void) {
   if (commandComplete) {
-    String command = commandInput.substring(0, commandInput.indexOf("/"));
-    String params = commandInput.substring(commandInput.indexOf("/")+1);
-    if (command.startsWith("COMMENT:")) {
+    // Split commandInput in place at the two first '/': command, name and value point into its buffer
+    int separator = commandInput.indexOf('/');
+    int valueSeparator = separator==-1?-1:commandInput.indexOf('/', separator+1);
+    const char * command = commandInput.c_str();
+    const char * name = "";
+    const char * value = NULL;
+    if (separator != -1) {
+      commandInput.setCharAt(separator, '\0');
+      name = command+separator+1;
+    }
+    if (valueSeparator != -1) {
+      commandInput.setCharAt(valueSeparator, '\0');
+      value = command+valueSeparator+1;
+    }
+    if (strncmp(command, "COMMENT:", 8) == 0) {
       // Comment send, do nothing
-    } else if (command == "NAME") {
-      Serial.print(prefix);
-      Serial.print("NAME:{\"value\":\"");
-      Serial.print(DEVICENAME);
-      Serial.print("\"}");
-      Serial.print(suffix);
-    } else if (command == "MARCO") {
-      Serial.print(prefix);
-      Serial.print("MARCO:{\"value\":\"POLO\"}");
-      Serial.print(suffix);
-    } else if (command == "OVERVIEW") {
+    } else if (strcmp(command, "NAME") == 0) {
+      responseStart("NAME");
+      responseAppend_P(PSTR("{\"value\":\"" DEVICENAME "\"}"));
+      responseSend();
+    } else if (strcmp(command, "MARCO") == 0) {
+      responseStart("MARCO");
+      responseAppend_P(PSTR("{\"value\":\"POLO\"}"));
+      responseSend();
+    } else if (strcmp(command, "OVERVIEW") == 0) {
       overview();
-    } else if (command == "SENSOR") {
-      int index = params.substring(params.length()-1).toInt();
-      if (params.startsWith("TEMPINT")) {
-        dhtTempHumTab[index].temperature = getDhtTemp(index);
-        Serial.print(prefix);
-        Serial.print(command);
-        Serial.print(":");
-        Serial.print("{\"value\":");
-        Serial.print(dhtTempHumTab[index].temperature, 1);
-        Serial.print("}");
-        Serial.print(suffix);
-      } else if (params.startsWith("HUMINT")) {
-        dhtTempHumTab[index].humidity = getDhtHum(index);
-        Serial.print(prefix);
-        Serial.print(command);
-        Serial.print(":");
-        Serial.print("{\"value\":");
-        Serial.print(dhtTempHumTab[index].humidity, 1);
-        Serial.print("}");
-        Serial.print(suffix);
-      } else if (params.startsWith("TEMPEXT")) {
-        Serial.print(prefix);
-        Serial.print(command);
-        Serial.print(":");
-        Serial.print("{\"value\":");
-        Serial.print(getDallasTemp(), 1);
-        Serial.print("}");
-        Serial.print(suffix);
-      } else if (params.startsWith("MVT")) {
-        Serial.print(prefix);
-        Serial.print(command);
-        Serial.print(":");
-        Serial.print("{\"value\":");
-        Serial.print(mvtDetected(index));
-        Serial.print("}");
-        Serial.print(suffix);
-      } else if (params.startsWith("LUM")) {
-        Serial.print(prefix);
-        Serial.print(command);
-        Serial.print(":");
-        Serial.print("{\"value\":");
-        Serial.print(getLight(index));
-        Serial.print("}");
-        Serial.print(suffix);
-      } else {
-        Serial.print(prefix);
-        Serial.print(command);
-        Serial.print(":");
-        Serial.print("{\"error\":\"sensor not found\"}");
-        Serial.print(suffix);
-      }
+    } else if (strcmp(command, "SENSOR") == 0) {
+      sensor(command, name);
+    } else if (strcmp(command, "SWITCH") == 0 || strcmp(command, "DIMMER") == 0) {
+      actuator(command, name, value);
     } else {
-      Serial.print(prefix);
-      Serial.print(command);
-      Serial.print(":");
-      Serial.print("{\"error\":\"command not found\"}");
-      Serial.print(suffix);
+      responseStart(command);
+      responseAppend_P(PSTR("{\"error\":\"command not found\"}"));
+      responseSend();
     }
     commandInput = "";
     commandComplete = false;
@@ -331,20 +604,29 @@ void loop(void) {
     }
   }
 
-  // Mouvement sensor, send an alert if no other alert has been sent for more than MVTALERTCYCLE cycles
-  if (digitalRead(mvtDetectTab[0].pin)) {
-    mvtDetectTab[0].lastDetect = millis();
-    if (!mvtDetectTab[0].sent) {
-      Serial.print(prefix);
-      Serial.print("{\"alert\":\"");
-      Serial.print("MVT0");
-      Serial.print("\"}");
-      Serial.print(suffix);
-      mvtDetectTab[0].sent = true;
-    }
-  } else {
-    if ((millis() - mvtDetectTab[0].lastDetect) > MVTALERTTIMEOUT && mvtDetectTab[0].sent) {
-      mvtDetectTab[0].sent = false;
+  // Mouvement sensors, send an alert if no other alert has been sent for more than MVTALERTTIMEOUT milliseconds
+  for (uint8_t i=0; i<MVT_COUNT; i++) {
+    if (digitalRead(mvtDetectTab[i].pin)) {
+      mvtDetectTab[i].lastDetect = millis();
+      if (!mvtDetectTab[i].sent) {
+        sensorDef def;
+        for (uint8_t j=0; j<SENSOR_COUNT; j++) {
+          memcpy_P(&def, &sensorTable[j], sizeof(sensorDef));
+          if (def.type == SENSOR_MVT && def.index == i) {
+            responseStart(NULL);
+            responseAppend_P(PSTR("{\"alert\":\""));
+            responseAppend_P(def.name);
+            responseAppend_P(PSTR("\"}"));
+            responseSend();
+            break;
+          }
+        }
+        mvtDetectTab[i].sent = true;
+      }
+    } else {
+      if ((millis() - mvtDetectTab[i].lastDetect) > MVTALERTTIMEOUT && mvtDetectTab[i].sent) {
+        mvtDetectTab[i].sent = false;
+      }
     }
   }
   delay(LOOP_DELAY);